@@ -1,4 +1,28 @@
+#include <stdlib.h>
+
+// The LBG searches of etcpack reseed rand() for each block, keep the state per thread (the LCG of msvcrt),
+// so the output of compress_batch doesn't depend on the scheduling.
+static thread_local unsigned int etc2_rand_seed = 1;
+
+static inline void
+etc2_srand(unsigned int seed) {
+	etc2_rand_seed = seed;
+}
+
+static inline int
+etc2_rand() {
+	etc2_rand_seed = etc2_rand_seed * 214013 + 2531011;
+	return (etc2_rand_seed >> 16) & 0x7fff;
+}
+
+#define srand etc2_srand
+#define rand etc2_rand
+#undef RAND_MAX
+#define RAND_MAX 0x7fff
+
 #include "etcpack.cxx"
+#undef srand
+#undef rand
 #undef R
 #undef G
 #undef B
@@ -13,6 +37,13 @@ extern "C" {
 
 }
 
+#include "image.h"
+#include "thread.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static inline void
 big_endian_encode(unsigned int block, uint8_t r[4]) {
 	r[0] = (uint8_t)(block >> 24);
@@ -26,107 +57,1343 @@ big_endian_decode(const uint8_t r[4]) {
 	return (unsigned int)r[0] << 24 | r[1] << 16 | r[2] << 8 | r[3];
 }
 
+#define EFFORT_FAST 0
+#define EFFORT_EXHAUSTIVE 4
+
+#define FORMAT_RGBA8 0
+#define FORMAT_SRGBA8 1	// the same blocks as RGBA8, only the KTX format differs
+#define FORMAT_R11 2
+#define FORMAT_RG11 3
+#define FORMAT_SIGNED_R11 4
+#define FORMAT_SIGNED_RG11 5
+
+static const char * format_name[] = { "rgba8", "srgba8", "r11", "rg11", "signed_r11", "signed_rg11", NULL };
+
+static const struct {
+	int blocksize;
+	unsigned int internalformat;	// for KTX
+	unsigned int baseformat;
+} format_info[] = {
+	{ 16, 0x9278, 0x1908 },	// COMPRESSED_RGBA8_ETC2_EAC, RGBA
+	{ 16, 0x9279, 0x1908 },	// COMPRESSED_SRGB8_ALPHA8_ETC2_EAC, RGBA
+	{ 8, 0x9270, 0x1903 },	// COMPRESSED_R11_EAC, RED
+	{ 16, 0x9272, 0x8227 },	// COMPRESSED_RG11_EAC, RG
+	{ 8, 0x9271, 0x1903 },	// COMPRESSED_SIGNED_R11_EAC, RED
+	{ 16, 0x9273, 0x8227 },	// COMPRESSED_SIGNED_RG11_EAC, RG
+};
+
+struct compress_option {
+	int effort;	// 0 (fast) - 4 (exhaustive)
+	int perceptual;
+	unsigned int threshold;	// stop searching when the block error is not greater than it, 0 disables
+	int format;
+};
+
+#define CANDIDATE_ETC1 0
+#define CANDIDATE_DIFFERENTIAL 1
+#define CANDIDATE_INDIVIDUAL 2
+#define CANDIDATE_PLANAR 3
+#define CANDIDATE_THUMB_H 4
+#define CANDIDATE_THUMB_T 5
+#define CANDIDATE_N 6
+
+// decode the block and return the error (x1000 if perceptual)
+static unsigned int
+measureBlockETC2(uint8 *img, uint8 *imgdec, int perceptual, unsigned int word1, unsigned int word2) {
+	decompressBlockETC2(word1, word2, imgdec, 4, 4, 0, 0);
+	if (perceptual) {
+		return (unsigned int)(1000*calcBlockPerceptualErrorRGB(img, imgdec, 4, 4, 0, 0));
+	} else {
+		return (unsigned int)calcBlockErrorRGB(img, imgdec, 4, 4, 0, 0);
+	}
+}
+
 /*
-	string source rgba
-	string flag	[21][fs][pn]
-		f fast default
-		s slow
-		p perceptual default
-		n nonperceptual
+	The tiers between compressBlockETC2Fast (effort 0) and compressBlockETC2Exhaustive (effort 4).
+	They run the passes of compressBlockETC2Exhaustive in the same order, but bound the search :
+	1 : exhaustive differential and planar modes, T and H modes by LBG
+	2 : and exhaustive individual mode
+	3 : and exhaustive H mode
+	4 : and exhaustive T mode, the same search as compressBlockETC2Exhaustive (used by the s flag with a threshold)
+	Return the error of the block (x1000 if perceptual).
+	The exhaustive ETC1 passes may return an error which doesn't match the words when they can't beat the bound,
+	so their results are measured by decoding.
  */
-static int
-lcompress(lua_State *L) {
-	size_t sz;
-	const char * data = luaL_checklstring(L, 1, &sz);
-	if (sz != 16*4) {
-		return luaL_error(L, "Not 4x4 RGBA block");
+static unsigned int
+compressBlockETC2Effort(uint8 *img, uint8 *imgdec, const struct compress_option *opt, unsigned int &compressed1, unsigned int &compressed2) {
+	const int width = 4, height = 4, startx = 0, starty = 0;
+	const int perceptual = opt->perceptual;
+	const unsigned int threshold = opt->threshold * (perceptual ? 1000 : 1);
+	unsigned int word1[CANDIDATE_N];
+	unsigned int word2[CANDIDATE_N];
+	unsigned int error[CANDIDATE_N];
+	unsigned int w1, w2;
+	unsigned int error_planar_red, error_planar_green, error_planar_blue;
+	int i;
+	for (i=0;i<CANDIDATE_N;i++) {
+		error[i] = 0xffffffff;
 	}
-	int fast = 1;
-	int perceptual = 1;
-	if (lua_isstring(L, 2)) {
-		const char *flags = lua_tostring(L, 2);
-		int i;
-		for (i=0;flags[i];i++) {
-			switch(flags[i]) {
-			case 's':
-				fast = 0;
-				break;
-			case 'f':
-				fast = 1;
-				break;
-			case 'p':
-				perceptual = 1;
-				break;
-			case 'n':
-				perceptual = 0;
+	unsigned int error_currently_best = perceptual ? 255*255*16*1000 : 255*255*16*3;
+#define UPDATE_BEST(c) if (error[c] < error_currently_best) error_currently_best = error[c];
+#define SEARCH_DONE (threshold > 0 && error_currently_best <= threshold)
+
+	// First pass, the same as compressBlockETC2Exhaustive
+	if (perceptual) {
+		compressBlockDiffFlipFastPerceptual(img, imgdec, width, height, startx, starty, word1[CANDIDATE_ETC1], word2[CANDIDATE_ETC1]);
+		decompressBlockDiffFlip(word1[CANDIDATE_ETC1], word2[CANDIDATE_ETC1], imgdec, width, height, startx, starty);
+		error[CANDIDATE_ETC1] = 1000*calcBlockPerceptualErrorRGB(img, imgdec, width, height, startx, starty);
+	} else {
+		error[CANDIDATE_ETC1] = (unsigned int) compressBlockDiffFlipFast(img, imgdec, width, height, startx, starty, word1[CANDIDATE_ETC1], word2[CANDIDATE_ETC1]);
+	}
+	UPDATE_BEST(CANDIDATE_ETC1)
+
+	compressBlockPlanar57(img, width, height, startx, starty, w1, w2);
+	decompressBlockPlanar57errorPerComponent(w1, w2, imgdec, width, height, startx, starty, img, error_planar_red, error_planar_green, error_planar_blue);
+	if (perceptual) {
+		error[CANDIDATE_PLANAR] = 1000*calcBlockPerceptualErrorRGB(img, imgdec, width, height, startx, starty);
+	} else {
+		error[CANDIDATE_PLANAR] = (unsigned int) calcBlockErrorRGB(img, imgdec, width, height, startx, starty);
+	}
+	stuff57bits(w1, w2, word1[CANDIDATE_PLANAR], word2[CANDIDATE_PLANAR]);
+	UPDATE_BEST(CANDIDATE_PLANAR)
+
+	if (perceptual) {
+		error[CANDIDATE_THUMB_T] = (unsigned int) compressBlockTHUMB59TFastestPerceptual1000(img, width, height, startx, starty, w1, w2);
+	} else {
+		error[CANDIDATE_THUMB_T] = (unsigned int) compressBlockTHUMB59TFastest(img, width, height, startx, starty, w1, w2);
+	}
+	stuff59bits(w1, w2, word1[CANDIDATE_THUMB_T], word2[CANDIDATE_THUMB_T]);
+	UPDATE_BEST(CANDIDATE_THUMB_T)
+
+	if (perceptual) {
+		error[CANDIDATE_THUMB_H] = (unsigned int) compressBlockTHUMB58HFastestPerceptual1000(img, width, height, startx, starty, w1, w2);
+	} else {
+		error[CANDIDATE_THUMB_H] = (unsigned int) compressBlockTHUMB58HFastest(img, width, height, startx, starty, w1, w2);
+	}
+	stuff58bits(w1, w2, word1[CANDIDATE_THUMB_H], word2[CANDIDATE_THUMB_H]);
+	UPDATE_BEST(CANDIDATE_THUMB_H)
+
+	// Second pass, bounded by error_currently_best
+	if (!SEARCH_DONE) {
+		if (perceptual) {
+			error[CANDIDATE_DIFFERENTIAL] = compressBlockDifferentialExhaustivePerceptual(img, width, height, startx, starty, word1[CANDIDATE_DIFFERENTIAL], word2[CANDIDATE_DIFFERENTIAL], error_currently_best);
+		} else {
+			error[CANDIDATE_DIFFERENTIAL] = compressBlockDifferentialExhaustive(img, width, height, startx, starty, word1[CANDIDATE_DIFFERENTIAL], word2[CANDIDATE_DIFFERENTIAL], error_currently_best);
+		}
+		if (error[CANDIDATE_DIFFERENTIAL] < error_currently_best) {
+			error[CANDIDATE_DIFFERENTIAL] = measureBlockETC2(img, imgdec, perceptual, word1[CANDIDATE_DIFFERENTIAL], word2[CANDIDATE_DIFFERENTIAL]);
+			UPDATE_BEST(CANDIDATE_DIFFERENTIAL)
+		} else {
+			error[CANDIDATE_DIFFERENTIAL] = 0xffffffff;
+		}
+	}
+	if (!SEARCH_DONE) {
+		unsigned int e;
+		if (perceptual) {
+			error_planar_red *= PERCEPTUAL_WEIGHT_R_SQUARED_TIMES1000;
+			error_planar_green *= PERCEPTUAL_WEIGHT_G_SQUARED_TIMES1000;
+			error_planar_blue *= PERCEPTUAL_WEIGHT_B_SQUARED_TIMES1000;
+			compressBlockPlanar57ExhaustivePerceptual(img, width, height, startx, starty, w1, w2, error_currently_best, error_planar_red, error_planar_green, error_planar_blue);
+			decompressBlockPlanar57(w1, w2, imgdec, width, height, startx, starty);
+			e = 1000*calcBlockPerceptualErrorRGB(img, imgdec, width, height, startx, starty);
+		} else {
+			compressBlockPlanar57Exhaustive(img, width, height, startx, starty, w1, w2, error_currently_best, error_planar_red, error_planar_green, error_planar_blue);
+			decompressBlockPlanar57(w1, w2, imgdec, width, height, startx, starty);
+			e = (unsigned int) calcBlockErrorRGB(img, imgdec, width, height, startx, starty);
+		}
+		if (e < error[CANDIDATE_PLANAR]) {
+			error[CANDIDATE_PLANAR] = e;
+			stuff57bits(w1, w2, word1[CANDIDATE_PLANAR], word2[CANDIDATE_PLANAR]);
+			UPDATE_BEST(CANDIDATE_PLANAR)
+		}
+	}
+	if (opt->effort >= 2 && !SEARCH_DONE) {
+		if (perceptual) {
+			error[CANDIDATE_INDIVIDUAL] = compressBlockIndividualExhaustivePerceptual(img, width, height, startx, starty, word1[CANDIDATE_INDIVIDUAL], word2[CANDIDATE_INDIVIDUAL], error_currently_best);
+		} else {
+			error[CANDIDATE_INDIVIDUAL] = compressBlockIndividualExhaustive(img, width, height, startx, starty, word1[CANDIDATE_INDIVIDUAL], word2[CANDIDATE_INDIVIDUAL], error_currently_best);
+		}
+		if (error[CANDIDATE_INDIVIDUAL] < error_currently_best) {
+			error[CANDIDATE_INDIVIDUAL] = measureBlockETC2(img, imgdec, perceptual, word1[CANDIDATE_INDIVIDUAL], word2[CANDIDATE_INDIVIDUAL]);
+			UPDATE_BEST(CANDIDATE_INDIVIDUAL)
+		} else {
+			error[CANDIDATE_INDIVIDUAL] = 0xffffffff;
+		}
+	}
+	if (!SEARCH_DONE) {
+		unsigned int e = 0xffffffff;
+		if (opt->effort >= 3) {
+			if (perceptual) {
+				e = compressBlockTHUMB58HExhaustivePerceptual(img, width, height, startx, starty, w1, w2, error_currently_best);
+			} else {
+				e = compressBlockTHUMB58HExhaustive(img, width, height, startx, starty, w1, w2, error_currently_best);
+			}
+			if (e < error_currently_best) {
+				unsigned int h1, h2;
+				stuff58bits(w1, w2, h1, h2);
+				e = measureBlockETC2(img, imgdec, perceptual, h1, h2);
+			} else {
+				e = 0xffffffff;
+			}
+		} else if (!perceptual) {
+			compressBlockTHUMB58HFast(img, width, height, startx, starty, w1, w2);
+			decompressBlockTHUMB58H(w1, w2, imgdec, width, height, startx, starty);
+			e = (unsigned int) calcBlockErrorRGB(img, imgdec, width, height, startx, starty);
+		}
+		if (e < error[CANDIDATE_THUMB_H]) {
+			error[CANDIDATE_THUMB_H] = e;
+			stuff58bits(w1, w2, word1[CANDIDATE_THUMB_H], word2[CANDIDATE_THUMB_H]);
+			UPDATE_BEST(CANDIDATE_THUMB_H)
+		}
+	}
+	if (!SEARCH_DONE) {
+		unsigned int e = 0xffffffff;
+		if (opt->effort >= 4) {
+			if (perceptual) {
+				e = compressBlockTHUMB59TExhaustivePerceptual(img, width, height, startx, starty, w1, w2, error_currently_best);
+			} else {
+				e = compressBlockTHUMB59TExhaustive(img, width, height, startx, starty, w1, w2, error_currently_best);
+			}
+			if (e < error_currently_best) {
+				unsigned int t1, t2;
+				stuff59bits(w1, w2, t1, t2);
+				e = measureBlockETC2(img, imgdec, perceptual, t1, t2);
+			} else {
+				e = 0xffffffff;
+			}
+		} else if (!perceptual) {
+			compressBlockTHUMB59TFast(img, width, height, startx, starty, w1, w2);
+			decompressBlockTHUMB59T(w1, w2, imgdec, width, height, startx, starty);
+			e = (unsigned int) calcBlockErrorRGB(img, imgdec, width, height, startx, starty);
+		}
+		if (e < error[CANDIDATE_THUMB_T]) {
+			error[CANDIDATE_THUMB_T] = e;
+			stuff59bits(w1, w2, word1[CANDIDATE_THUMB_T], word2[CANDIDATE_THUMB_T]);
+		}
+	}
+#undef UPDATE_BEST
+#undef SEARCH_DONE
+
+	// the same order as compressBlockETC2Exhaustive
+	int best = CANDIDATE_ETC1;
+	for (i=1;i<CANDIDATE_N;i++) {
+		if (error[i] < error[best])
+			best = i;
+	}
+	compressed1 = word1[best];
+	compressed2 = word2[best];
+	return error[best];
+}
+
+/*
+	compressBlockETC2Fast with early exit : the modes are tried in an order chosen by the block statistics,
+	and the search stops when the error of the best mode is not greater than the threshold.
+	Smooth blocks (low variance) try planar and ETC1 first, so they usually skip the T and H modes.
+	Blocks with few distinct colors and high variance try H and T first.
+	Return the error of the block (x1000 if perceptual).
+ */
+#define SMOOTH_VARIANCE 64	// per pixel, sum of 3 channels
+
+static unsigned int
+compressBlockETC2FastThreshold(uint8 *img, uint8 *imgdec, const struct compress_option *opt, unsigned int &compressed1, unsigned int &compressed2) {
+	const int width = 4, height = 4, startx = 0, starty = 0;
+	const int perceptual = opt->perceptual;
+	const unsigned int threshold = opt->threshold * (perceptual ? 1000 : 1);
+	static const int order_smooth[] = { CANDIDATE_PLANAR, CANDIDATE_ETC1, CANDIDATE_THUMB_T, CANDIDATE_THUMB_H };
+	static const int order_default[] = { CANDIDATE_ETC1, CANDIDATE_PLANAR, CANDIDATE_THUMB_T, CANDIDATE_THUMB_H };
+	static const int order_palette[] = { CANDIDATE_THUMB_H, CANDIDATE_THUMB_T, CANDIDATE_ETC1, CANDIDATE_PLANAR };
+	unsigned int word1[CANDIDATE_N];
+	unsigned int word2[CANDIDATE_N];
+	unsigned int error[CANDIDATE_N];
+	unsigned int w1, w2;
+	int i, j;
+	for (i=0;i<CANDIDATE_N;i++) {
+		error[i] = 0xffffffff;
+	}
+
+	// block statistics
+	int sum[3] = { 0, 0, 0 };
+	int sqr = 0;
+	int colors = 0;
+	for (i=0;i<16;i++) {
+		const uint8 *c = img + i * 3;
+		sum[0] += c[0];
+		sum[1] += c[1];
+		sum[2] += c[2];
+		sqr += c[0] * c[0] + c[1] * c[1] + c[2] * c[2];
+		for (j=0;j<i;j++) {
+			const uint8 *p = img + j * 3;
+			if (p[0] == c[0] && p[1] == c[1] && p[2] == c[2])
 				break;
-			default:
-				return luaL_error(L, "Unknown flags %s", flags);
+		}
+		if (j == i)
+			++colors;
+	}
+	// 16 * 16 * variance
+	int variance = 16 * sqr - sum[0] * sum[0] - sum[1] * sum[1] - sum[2] * sum[2];
+	const int *order;
+	if (variance <= SMOOTH_VARIANCE * 16 * 16) {
+		order = order_smooth;
+	} else if (colors <= 4) {
+		order = order_palette;
+	} else {
+		order = order_default;
+	}
+
+	unsigned int error_best = 0xffffffff;
+	int best = CANDIDATE_ETC1;
+	for (i=0;i<4;i++) {
+		int c = order[i];
+		switch (c) {
+		case CANDIDATE_ETC1:
+			if (perceptual) {
+				compressBlockDiffFlipFastPerceptual(img, imgdec, width, height, startx, starty, w1, w2);
+			} else {
+				compressBlockDiffFlipFast(img, imgdec, width, height, startx, starty, w1, w2);
+			}
+			word1[c] = w1;
+			word2[c] = w2;
+			break;
+		case CANDIDATE_PLANAR:
+			compressBlockPlanar57(img, width, height, startx, starty, w1, w2);
+			stuff57bits(w1, w2, word1[c], word2[c]);
+			break;
+		case CANDIDATE_THUMB_T:
+			if (perceptual) {
+				compressBlockTHUMB59TFastestPerceptual1000(img, width, height, startx, starty, w1, w2);
+			} else {
+				compressBlockTHUMB59TFastest(img, width, height, startx, starty, w1, w2);
+			}
+			stuff59bits(w1, w2, word1[c], word2[c]);
+			break;
+		case CANDIDATE_THUMB_H:
+			if (perceptual) {
+				compressBlockTHUMB58HFastestPerceptual1000(img, width, height, startx, starty, w1, w2);
+			} else {
+				compressBlockTHUMB58HFastest(img, width, height, startx, starty, w1, w2);
+			}
+			stuff58bits(w1, w2, word1[c], word2[c]);
+			break;
+		}
+		error[c] = measureBlockETC2(img, imgdec, perceptual, word1[c], word2[c]);
+		if (error[c] < error_best) {
+			error_best = error[c];
+			best = c;
+		}
+		if (error_best <= threshold)
+			break;
+	}
+	// the same order as compressBlockETC2Fast when the errors are equal
+	static const int select[] = { CANDIDATE_ETC1, CANDIDATE_PLANAR, CANDIDATE_THUMB_T, CANDIDATE_THUMB_H };
+	for (i=0;i<4;i++) {
+		if (error[select[i]] == error_best) {
+			best = select[i];
+			break;
+		}
+	}
+	// compress T or H a little bit harder if it wins
+	if (error_best > threshold && (best == CANDIDATE_THUMB_T || best == CANDIDATE_THUMB_H)) {
+		unsigned int h1, h2;
+		if (best == CANDIDATE_THUMB_T) {
+			compressBlockTHUMB59TFast(img, width, height, startx, starty, w1, w2);
+			stuff59bits(w1, w2, h1, h2);
+		} else {
+			compressBlockTHUMB58HFast(img, width, height, startx, starty, w1, w2);
+			stuff58bits(w1, w2, h1, h2);
+		}
+		unsigned int e = measureBlockETC2(img, imgdec, perceptual, h1, h2);
+		if (e < error_best) {
+			error_best = e;
+			word1[best] = h1;
+			word2[best] = h2;
+		}
+	}
+	compressed1 = word1[best];
+	compressed2 = word2[best];
+	return error_best;
+}
+
+#if defined(__SSE2__)
+
+static inline __m128i
+absdiff_epu8(__m128i a, __m128i b) {
+	return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+static inline __m128i
+select_si128(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// sum of squared differences of the 16 pixels of (table, alpha), the same as the inner loop of compressBlockAlphaSlow
+static inline int
+alpha_block_error(__m128i pixels, int table, int alpha) {
+	int v[8];
+	int i;
+	for (i=0;i<8;i++) {
+		v[i] = clamp_table[alpha + alphaTable[table][i] + 255];
+	}
+	const __m128i ones = _mm_cmpeq_epi8(pixels, pixels);
+	__m128i a = _mm_set1_epi8((char)alpha);
+	// pixel > alpha
+	__m128i hi = _mm_xor_si128(_mm_cmpeq_epi8(_mm_max_epu8(pixels, a), a), ones);
+
+	// pixels above alpha search 7-6-5-4 while the difference doesn't increase
+	__m128i best_hi = absdiff_epu8(pixels, _mm_set1_epi8((char)v[7]));
+	__m128i active = ones;
+	for (i=6;i>=4;i--) {
+		__m128i d = absdiff_epu8(pixels, _mm_set1_epi8((char)v[i]));
+		active = _mm_and_si128(active, _mm_cmpeq_epi8(_mm_min_epu8(d, best_hi), d));
+		best_hi = select_si128(active, d, best_hi);
+	}
+	// others search 0-1-2-3-4 while the difference decreases
+	__m128i best_lo = absdiff_epu8(pixels, _mm_set1_epi8((char)v[0]));
+	active = ones;
+	for (i=1;i<=4;i++) {
+		__m128i d = absdiff_epu8(pixels, _mm_set1_epi8((char)v[i]));
+		active = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_min_epu8(d, best_lo), best_lo), active);
+		best_lo = select_si128(active, d, best_lo);
+	}
+	__m128i diff = select_si128(hi, best_hi, best_lo);
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo16 = _mm_unpacklo_epi8(diff, zero);
+	__m128i hi16 = _mm_unpackhi_epi8(diff, zero);
+	__m128i sum = _mm_add_epi32(_mm_madd_epi16(lo16, lo16), _mm_madd_epi16(hi16, hi16));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1,0,3,2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2,3,0,1)));
+	return _mm_cvtsi128_si32(sum);
+}
+
+/*
+	compressBlockAlphaSlow for a 4x4 block (16 bytes), it produces the same output.
+	The original loop tests the pixels one by one for each (table, alpha),
+	here the 16 pixels are tested against the modifiers together.
+ */
+static void
+compress_alpha_slow(uint8 *data, uint8 *returnData) {
+	__m128i pixels = _mm_loadu_si128((const __m128i *)data);
+	int alphasum = 0;
+	int i;
+	for (i=0;i<16;i++) {
+		alphasum += data[i];
+	}
+	int alpha = (int)(((float)alphasum)/16.0f+0.5f);
+	int bestsum = 1000000000;
+	int besttable = -3;
+	int bestalpha = 128;
+	int table;
+	for (table = 0; table < 256 && bestsum > 0; table++) {
+		int tablealpha = alpha;
+		int tablebestsum = 1000000000;
+		int alphascale;
+		for (alphascale = 32; alphascale > 0; alphascale /= 8) {
+			int startalpha = clamp(tablealpha-alphascale*4);
+			int endalpha = clamp(tablealpha+alphascale*4);
+			int a;
+			for (a = startalpha; a <= endalpha; a += alphascale) {
+				int sum = alpha_block_error(pixels, table, a);
+				if (sum < tablebestsum) {
+					tablebestsum = sum;
+					tablealpha = a;
+				}
+				if (sum < bestsum) {
+					bestsum = sum;
+					besttable = table;
+					bestalpha = a;
+				}
+			}
+			if (alphascale == 4)
+				alphascale = 8;
+		}
+	}
+	alpha = bestalpha;
+	returnData[0] = alpha;
+	returnData[1] = besttable;
+	for (i=2;i<8;i++) {
+		returnData[i] = 0;
+	}
+	// indices are stored in column-major order
+	int byte = 2;
+	int bit = 0;
+	int x, y;
+	for (x=0;x<4;x++) {
+		for (y=0;y<4;y++) {
+			int val = data[x+y*4];
+			int besterror = 1000000;
+			int bestindex = 99;
+			int index;
+			for (index=0;index<8;index++) {
+				int d = clamp(alpha + alphaTable[besttable][index]) - val;
+				if (d*d < besterror) {
+					besterror = d*d;
+					bestindex = index;
+				}
+			}
+			int numbit;
+			for (numbit=0;numbit<3;numbit++) {
+				returnData[byte] |= getbit(bestindex, 2-numbit, 7-bit);
+				bit++;
+				if (bit > 7) {
+					bit = 0;
+					byte++;
+				}
+			}
+		}
+	}
+}
+
+#else
+
+static inline void
+compress_alpha_slow(uint8 *data, uint8 *returnData) {
+	compressBlockAlphaSlow(data, 0, 0, 4, 4, returnData);
+}
+
+#endif
+
+/*
+	11-bit EAC (R11 and RG11), the same search as compressBlockAlpha16, without the globals valtab and formatSigned,
+	so the signed and unsigned formats can be compressed at the same time.
+	The values are in 16 bits (the signed ones are shifted by 32768) as valtab.
+ */
+static uint16_t eac11_value[2][256][16][16][8];	// [signed][base][table][mul][index]
+static uint16_t eac11_range[2][256][16][16][2];	// min and max of the values
+
+static int eac11_ready[2];
+
+// fill the tables of signed or unsigned format on demand, call it from the lua thread before compressing
+static void
+setup_eac11_table(int s) {
+	if (eac11_ready[s])
+		return;
+	int base, table, mul, index;
+	for (base=0;base<256;base++) {
+		for (table=0;table<16;table++) {
+			for (mul=0;mul<16;mul++) {
+				uint16_t *value = eac11_value[s][base][table][mul];
+				for (index=0;index<8;index++) {
+					if (s) {
+						value[index] = (uint16_t)(get16bits11signed(base, table, mul, index) + 256*128);
+					} else {
+						value[index] = get16bits11bits(base, table, mul, index);
+					}
+				}
+				uint16_t vmin = value[0], vmax = value[0];
+				for (index=1;index<8;index++) {
+					if (value[index] < vmin)
+						vmin = value[index];
+					if (value[index] > vmax)
+						vmax = value[index];
+				}
+				eac11_range[s][base][table][mul][0] = vmin;
+				eac11_range[s][base][table][mul][1] = vmax;
+			}
+		}
+	}
+	eac11_ready[s] = 1;
+}
+
+// the tables used by format
+static void
+setup_format(int format) {
+	if (format == FORMAT_R11 || format == FORMAT_RG11) {
+		setup_eac11_table(0);
+	} else if (format == FORMAT_SIGNED_R11 || format == FORMAT_SIGNED_RG11) {
+		setup_eac11_table(1);
+	}
+}
+
+// 8-bit channel to the 16-bit value, the signed value 128 is 0.0, 1 and 0 are -1.0
+static inline int
+eac11_expand(int v, int is_signed) {
+	if (!is_signed)
+		return v * 257;
+	int x = 32768 + ((v - 128) * 32767 * 2 + 127) / 254;
+	return x < 1 ? 1 : x;
+}
+
+#if defined(__SSE2__)
+
+static inline __m128i
+absdiff_epu16(__m128i a, __m128i b) {
+	return _mm_or_si128(_mm_subs_epu16(a, b), _mm_subs_epu16(b, a));
+}
+
+static inline __m128i
+min_epu16(__m128i a, __m128i b) {
+	return _mm_sub_epi16(a, _mm_subs_epu16(a, b));
+}
+
+// sum of the squared differences of 8 pixels, 2 x 64bit
+static inline __m128i
+square_sum_epu16(__m128i d) {
+	__m128i lo = _mm_mullo_epi16(d, d);
+	__m128i hi = _mm_mulhi_epu16(d, d);
+	__m128i zero = _mm_setzero_si128();
+	__m128i sq0 = _mm_unpacklo_epi16(lo, hi);
+	__m128i sq1 = _mm_unpackhi_epi16(lo, hi);
+	__m128i sum = _mm_add_epi64(_mm_unpacklo_epi32(sq0, zero), _mm_unpackhi_epi32(sq0, zero));
+	sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(sq1, zero));
+	return _mm_add_epi64(sum, _mm_unpackhi_epi32(sq1, zero));
+}
+
+// the error of 8 pixels
+static inline uint64_t
+eac11_error8(__m128i p, const uint16_t value[8]) {
+	__m128i d = absdiff_epu16(p, _mm_set1_epi16(value[0]));
+	int i;
+	for (i=1;i<8;i++) {
+		d = min_epu16(d, absdiff_epu16(p, _mm_set1_epi16(value[i])));
+	}
+	__m128i sum = square_sum_epu16(d);
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+	uint64_t r;
+	_mm_storel_epi64((__m128i *)&r, sum);
+	return r;
+}
+
+// stop after the first 8 pixels when the error is not less than bound
+static inline uint64_t
+eac11_error(const uint16_t pixel[16], const uint16_t value[8], uint64_t bound) {
+	uint64_t error = eac11_error8(_mm_loadu_si128((const __m128i *)pixel), value);
+	if (error >= bound)
+		return error;
+	return error + eac11_error8(_mm_loadu_si128((const __m128i *)(pixel + 8)), value);
+}
+
+#else
+
+// stop when the error is not less than bound
+static inline uint64_t
+eac11_error(const uint16_t pixel[16], const uint16_t value[8], uint64_t bound) {
+	uint64_t error = 0;
+	int i, j;
+	for (i=0;i<16;i++) {
+		uint64_t best = (uint64_t)1 << 40;
+		for (j=0;j<8;j++) {
+			int64_t d = pixel[i] - value[j];
+			if ((uint64_t)(d*d) < best)
+				best = d*d;
+		}
+		error += best;
+		if (error >= bound)
+			break;
+	}
+	return error;
+}
+
+#endif
+
+#if defined(ETC2_REFERENCE)
+
+// Build with ETC2_REFERENCE to use compressBlockAlpha16 of etcpack.cxx instead, see test/etc2.lua .
+// It depends on the globals formatSigned and valtab, so it's not thread safe.
+static void
+reference_eac11(const uint16_t pixel[16], int is_signed, uint8_t result[8]) {
+	if (formatSigned != is_signed) {
+		formatSigned = is_signed;
+		delete[] valtab;
+		setupAlphaTableAndValtab();
+	}
+	uint8 data[16*2];	// 16-bit big-endian, as the pgm file
+	int i;
+	for (i=0;i<16;i++) {
+		data[i*2] = pixel[i] >> 8;
+		data[i*2+1] = pixel[i] & 0xff;
+	}
+	compressBlockAlpha16(data, 0, 0, 4, 4, result);
+}
+
+#endif
+
+static inline uint64_t
+square64(int64_t x) {
+	return (uint64_t)(x * x);
+}
+
+// pixel : 16 values in row-major order (in 16 bits), result : 8 bytes
+static void
+compress_eac11(const uint16_t pixel[16], int is_signed, uint8_t result[8]) {
+#if defined(ETC2_REFERENCE)
+	reference_eac11(pixel, is_signed, result);
+	return;
+#endif
+	int pmin = pixel[0], pmax = pixel[0];
+	int i;
+	for (i=1;i<16;i++) {
+		if (pixel[i] < pmin)
+			pmin = pixel[i];
+		if (pixel[i] > pmax)
+			pmax = pixel[i];
+	}
+	uint64_t besterror = (uint64_t)1 << 40;
+	int bestbase = 0, besttable = 0, bestmul = 0;
+	int base, table, mul;
+	for (base=0;base<256;base++) {
+		for (table=0;table<16;table++) {
+			for (mul=0;mul<16;mul++) {
+				const uint16_t *range = eac11_range[is_signed][base][table][mul];
+				int vmin = range[0], vmax = range[1];
+				// the min and max pixels can't be closer than the range of the values
+				uint64_t bound = 0;
+				if (pmax > vmax)
+					bound += square64(pmax - vmax);
+				if (pmin < vmin)
+					bound += square64(vmin - pmin);
+				if (bound >= besterror)
+					continue;
+				uint64_t e = eac11_error(pixel, eac11_value[is_signed][base][table][mul], besterror);
+				if (e < besterror) {
+					besterror = e;
+					bestbase = base;
+					besttable = table;
+					bestmul = mul;
+				}
+			}
+		}
+	}
+	result[0] = is_signed ? (uint8_t)(bestbase - 128) : (uint8_t)bestbase;
+	result[1] = (uint8_t)((bestmul << 4) + besttable);
+	for (i=2;i<8;i++) {
+		result[i] = 0;
+	}
+	const uint16_t *value = eac11_value[is_signed][bestbase][besttable][bestmul];
+	// indices are stored in column-major order
+	int byte = 2;
+	int bit = 0;
+	int x, y;
+	for (x=0;x<4;x++) {
+		for (y=0;y<4;y++) {
+			uint64_t error = (uint64_t)(255*255) * (255*255);
+			int bestindex = 99;
+			int index;
+			for (index=0;index<8;index++) {
+				uint64_t e = square64(pixel[x+y*4] - value[index]);
+				if (e < error) {
+					error = e;
+					bestindex = index;
+				}
+			}
+			int numbit;
+			for (numbit=0;numbit<3;numbit++) {
+				result[byte] |= getbit(bestindex, 2-numbit, 7-bit);
+				bit++;
+				if (bit > 7) {
+					bit = 0;
+					byte++;
+				}
 			}
 		}
 	}
-	uint8_t color[16*16*3];
-	uint8_t color_dec[16*16*3];
-	uint8_t alpha[16*16];
-	uint8_t result[16];
+}
+
+static void
+uncompress_eac11(const uint8_t data[8], int is_signed, uint8_t *result, int channel) {
+	int base = is_signed ? (int)(signed char)data[0] + 128 : data[0];
+	const uint16_t *value = eac11_value[is_signed][base][data[1] % 16][data[1] / 16];
+	int byte = 2;
+	int bit = 0;
+	int x, y;
+	for (x=0;x<4;x++) {
+		for (y=0;y<4;y++) {
+			int index = 0;
+			int bitpos;
+			for (bitpos=0;bitpos<3;bitpos++) {
+				index |= getbit(data[byte], 7-bit, 2-bitpos);
+				bit++;
+				if (bit > 7) {
+					bit = 0;
+					byte++;
+				}
+			}
+			result[(x+y*4)*4+channel] = value[index] >> 8;
+		}
+	}
+}
+
+static void
+compress_block_eac11(const uint8_t *data, const struct compress_option *opt, uint8_t *result) {
+	int is_signed = opt->format == FORMAT_SIGNED_R11 || opt->format == FORMAT_SIGNED_RG11;
+	int channels = (opt->format == FORMAT_RG11 || opt->format == FORMAT_SIGNED_RG11) ? 2 : 1;
+	uint16_t pixel[16];
+	int c, i;
+	for (c=0;c<channels;c++) {
+		for (i=0;i<16;i++) {
+			pixel[i] = eac11_expand(data[i*4+c], is_signed);
+		}
+		compress_eac11(pixel, is_signed, result + c * 8);
+	}
+}
+
+static void
+compress_block_rgba(const uint8_t *data, const struct compress_option *opt, uint8_t result[16]) {
+	uint8_t color[16*3];
+	uint8_t color_dec[16*3];
+	uint8_t alpha[16];
 	int i;
-	for (i=0;i<16*16;i++) {
+	for (i=0;i<16;i++) {
 		color[i*3+0] = data[i*4+0];
 		color[i*3+1] = data[i*4+1];
 		color[i*3+2] = data[i*4+2];
 		alpha[i] = data[i*4+3];
 	}
 	unsigned int block1, block2;
-	if (fast) {
-		if (perceptual) {
+	if (opt->effort == EFFORT_FAST && opt->threshold > 0) {
+		compressBlockETC2FastThreshold(color, color_dec, opt, block1, block2);
+	} else if (opt->effort == EFFORT_FAST) {
+		if (opt->perceptual) {
 			compressBlockETC2FastPerceptual(color, color_dec, 4, 4, 0, 0, block1, block2);
 		} else {
 			compressBlockETC2Fast(color, alpha, color_dec, 4, 4, 0, 0, block1, block2);
 		}
-	} else {
-		if (perceptual) {
+	} else if (opt->effort == EFFORT_EXHAUSTIVE && opt->threshold == 0) {
+		if (opt->perceptual) {
 			compressBlockETC2ExhaustivePerceptual(color, color_dec, 4, 4, 0, 0, block1, block2);
 		} else {
 			compressBlockETC2Exhaustive(color, color_dec, 4, 4, 0, 0, block1, block2);
 		}
+	} else {
+		compressBlockETC2Effort(color, color_dec, opt, block1, block2);
 	}
-	if (fast) {
+	if (opt->effort <= 1) {
 		compressBlockAlphaFast(alpha, 0, 0, 4, 4, result);
 	} else {
-		compressBlockAlphaSlow(alpha, 0, 0, 4, 4, result);
+		compress_alpha_slow(alpha, result);
 	}
 
 	big_endian_encode(block1, result+8);
 	big_endian_encode(block2, result+12);
+}
 
-	lua_pushlstring(L, (const char *)result, 16);
+// write format_info[opt->format].blocksize bytes to result
+static inline void
+compress_block(const uint8_t *data, const struct compress_option *opt, uint8_t *result) {
+	if (opt->format == FORMAT_RGBA8 || opt->format == FORMAT_SRGBA8) {
+		compress_block_rgba(data, opt, result);
+	} else {
+		compress_block_eac11(data, opt, result);
+	}
+}
+
+// flags at index, and the threshold follows
+static void
+get_option(lua_State *L, int index, struct compress_option *opt) {
+	opt->format = FORMAT_RGBA8;
+	opt->effort = EFFORT_FAST;
+	opt->perceptual = 1;
+	opt->threshold = (unsigned int)luaL_optinteger(L, index + 1, 0);
+	if (lua_isstring(L, index)) {
+		const char *flags = lua_tostring(L, index);
+		int i;
+		for (i=0;flags[i];i++) {
+			switch(flags[i]) {
+			case 's':
+				opt->effort = EFFORT_EXHAUSTIVE;
+				break;
+			case 'f':
+				opt->effort = EFFORT_FAST;
+				break;
+			case '0': case '1': case '2': case '3': case '4':
+				opt->effort = flags[i] - '0';
+				break;
+			case 'p':
+				opt->perceptual = 1;
+				break;
+			case 'n':
+				opt->perceptual = 0;
+				break;
+			default:
+				luaL_error(L, "Unknown flags %s", flags);
+			}
+		}
+	}
+}
+
+/*
+	string source rgba, 4x4 block (64 bytes), or n blocks (n * 64 bytes, as loadimage's "linear" blocks)
+		or image userdata (see image.h), all the 4x4 blocks of the image in row-major, pixels out of the image are 0
+	string flag	[21][fs01234][pn]
+		f fast default (effort 0)
+		s slow (effort 4, exhaustive)
+		1-3 effort between fast and slow, see compressBlockETC2Effort
+		p perceptual default
+		n nonperceptual
+	integer threshold (optional) : stop searching the modes when the error of the block (sum of squared errors) is not greater than it.
+		0 (default) disables it. Effort 0 also orders the modes by the block statistics, see compressBlockETC2FastThreshold
+	string format (optional) : rgba8 (default), srgba8, r11, rg11, signed_r11, signed_rg11
+		srgba8 is the same as rgba8 (the colors are in sRGB space already).
+		r11 uses the red channel, rg11 uses the red and green channels. For the signed formats, 128 is 0.0 .
+		The flags and threshold are ignored by 11-bit formats, they are always exhaustive.
+
+	return string (16 bytes per block, 8 bytes for r11 and signed_r11)
+ */
+static int
+lcompress(lua_State *L) {
+	struct image * img = image_test(L, 1);
+	size_t sz = 0;
+	const char * data = NULL;
+	if (img == NULL) {
+		data = luaL_checklstring(L, 1, &sz);
+		if (sz == 0 || sz % (16*4) != 0) {
+			return luaL_error(L, "Not 4x4 RGBA block");
+		}
+	}
+	struct compress_option opt;
+	get_option(L, 2, &opt);
+	opt.format = luaL_checkoption(L, 4, "rgba8", format_name);
+	setup_format(opt.format);
+	const int blocksize = format_info[opt.format].blocksize;
+	if (img) {
+		int bw = (img->width + 3) / 4;
+		int bh = (img->height + 3) / 4;
+		size_t n = (size_t)bw * bh;
+		luaL_Buffer b;
+		uint8_t * result = (uint8_t *)luaL_buffinitsize(L, &b, n * blocksize);
+		if (img->format == IMAGE_BLOCK4X4) {
+			// blocks are contiguous already
+			size_t i;
+			for (i=0;i<n;i++) {
+				compress_block(img->data + i * 64, &opt, result + i * blocksize);
+			}
+			luaL_pushresultsize(&b, n * blocksize);
+			return 1;
+		}
+		uint8_t block[64];
+		int i,j;
+		for (i=0;i<bh;i++) {
+			for (j=0;j<bw;j++) {
+				image_block(img, j*4, i*4, block);
+				compress_block(block, &opt, result);
+				result += blocksize;
+			}
+		}
+		luaL_pushresultsize(&b, n * blocksize);
+		return 1;
+	}
+	size_t n = sz / (16*4);
+	luaL_Buffer b;
+	uint8_t * result = (uint8_t *)luaL_buffinitsize(L, &b, n * blocksize);
+	size_t i;
+	for (i=0;i<n;i++) {
+		compress_block((const uint8_t *)data + i * 64, &opt, result + i * blocksize);
+	}
+	luaL_pushresultsize(&b, n * blocksize);
 
 	return 1;
 }
 
+#if defined(ETC2_REFERENCE)
+
+void decompressBlockETC2c(unsigned int block_part1, unsigned int block_part2, uint8 *img, int width, int height, int startx, int starty, int channels);
+void decompressBlockAlphaC(uint8* data, uint8* img, int width, int height, int ix, int iy, int channels);
+
+// the original decoder of etcdec.cxx, see test/etc2.lua
+static void
+reference_decompress(const uint8 *data, uint8 *rgba) {
+	decompressBlockAlphaC((uint8 *)data, rgba + 3, 4, 4, 0, 0, 4);
+	decompressBlockETC2c(big_endian_decode(data + 8), big_endian_decode(data + 12), rgba, 4, 4, 0, 0, 4);
+}
+
+#define decompressBlockETC2RGBA reference_decompress
+
+#else
+
+// in etcdec.cxx, the same pixels as decompressBlockAlpha + decompressBlockETC2
+void decompressBlockETC2RGBA(const uint8 *data, uint8 *rgba);
+
+#endif
+
+// 64 bytes rgba, see uncompress for the 11-bit formats
+static void
+uncompress_block(const uint8_t *data, int format, uint8_t result[16*4]) {
+	if (format == FORMAT_RGBA8 || format == FORMAT_SRGBA8) {
+		decompressBlockETC2RGBA(data, result);
+		return;
+	}
+	int is_signed = format == FORMAT_SIGNED_R11 || format == FORMAT_SIGNED_RG11;
+	int channels = format_info[format].blocksize / 8;
+	int i;
+	for (i=0;i<16;i++) {
+		result[i*4+0] = 0;
+		result[i*4+1] = 0;
+		result[i*4+2] = 0;
+		result[i*4+3] = 255;
+	}
+	for (i=0;i<channels;i++) {
+		uncompress_eac11(data + i * 8, is_signed, result, i);
+	}
+}
+
+/*
+	string ETC2 RGBA block (16 bytes) or n blocks
+	string format (optional) : see compress, the 11-bit formats are uncompressed into the red (and green) channel,
+		the high 8 bits of the 16-bit values (signed values are shifted by 32768). Other channels are 0, alpha is 255.
+
+	return 64 bytes rgba per block
+ */
 static int
 luncompress(lua_State *L) {
 	size_t sz;
 	const char * data = luaL_checklstring(L, 1, &sz);
-	if (sz != 16) {
-		return luaL_error(L, "The size of ETC2 RGBA block should be 16 bytes.");
-	}
-	uint8_t alphaimg[16];
-	decompressBlockAlpha((uint8 *)(data),alphaimg,4,4,0,0);
-	uint8_t img[16*3];
-	unsigned int block1 = big_endian_decode((const uint8_t *)(data + 8));
-	unsigned int block2 = big_endian_decode((const uint8_t *)(data + 12));
-	decompressBlockETC2(block1, block2,img,4,4,0,0);
-	uint8_t result[16*4];
+	int format = luaL_checkoption(L, 2, "rgba8", format_name);
+	setup_format(format);
+	const int blocksize = format_info[format].blocksize;
+	if (sz == 0 || sz % blocksize != 0) {
+		return luaL_error(L, "The size of %s block should be %d bytes.", format_name[format], blocksize);
+	}
+	size_t n = sz / blocksize;
+	luaL_Buffer b;
+	uint8_t * result = (uint8_t *)luaL_buffinitsize(L, &b, n * 16 * 4);
+	size_t i;
+	for (i=0;i<n;i++) {
+		uncompress_block((const uint8_t *)data + i * blocksize, format, result + i * 64);
+	}
+	luaL_pushresultsize(&b, n * 16 * 4);
+
+	return 1;
+}
+
+#define BATCH_BLOCKS 64	// blocks per job
+
+struct compress_source {
+	const struct image *img;	// NULL for string source
+	const uint8_t *data;
+	size_t n;	// number of blocks
+	uint8_t *output;
+	uint8_t *diff;	// absolute differences of the pixels (64 bytes per block, as the source block), for the sprites
+};
+
+struct compress_job {
+	const struct compress_source *source;
+	const struct compress_option *opt;
+	int blocksize;
+	int metrics;
+	size_t from;
+	size_t to;
+	uint64_t err[4];	// sum of squared errors of r g b a
+};
+
+// compare the compressed block with the source block, w x h pixels are in the image
+static void
+measure_block(struct compress_job *job, const uint8_t *block, const uint8_t *compressed, int w, int h, uint8_t *diff) {
+	uint8_t dec[16*4];
+	uncompress_block(compressed, job->opt->format, dec);
+	int x, y, c;
+	for (y=0;y<4;y++) {
+		for (x=0;x<4;x++) {
+			int p = (y*4+x)*4;
+			int inside = x < w && y < h;
+			for (c=0;c<4;c++) {
+				int d = abs(dec[p+c] - block[p+c]);
+				if (inside)
+					job->err[c] += d * d;
+				if (diff)
+					diff[p+c] = (uint8_t)d;
+			}
+		}
+	}
+}
+
+static void
+compress_batch_job(void *ud, int index) {
+	struct compress_job *job = (struct compress_job *)ud + index;
+	const struct compress_source *src = job->source;
+	size_t i;
+	if (src->img == NULL) {
+		for (i=job->from;i<job->to;i++) {
+			uint8_t *output = src->output + i * job->blocksize;
+			compress_block(src->data + i * 64, job->opt, output);
+			if (job->metrics)
+				measure_block(job, src->data + i * 64, output, 4, 4, NULL);
+		}
+		return;
+	}
+	const struct image *img = src->img;
+	int bw = (img->width + 3) / 4;
+	uint8_t block[64];
+	for (i=job->from;i<job->to;i++) {
+		int x = (int)(i % bw) * 4;
+		int y = (int)(i / bw) * 4;
+		uint8_t *output = src->output + i * job->blocksize;
+		image_block(img, x, y, block);
+		compress_block(block, job->opt, output);
+		if (job->metrics)
+			measure_block(job, block, output, img->width - x, img->height - y, src->diff ? src->diff + i * 64 : NULL);
+	}
+}
+
+static void
+set_number(lua_State *L, const char *key, double v) {
+	lua_pushnumber(L, v);
+	lua_setfield(L, -2, key);
+}
+
+static inline double
+psnr(double mse) {
+	return mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : HUGE_VAL;
+}
+
+// push { mse, psnr, wmse, wpsnr, alpha_mse, alpha_psnr } of the squared errors
+static void
+push_quality(lua_State *L, const uint64_t err[4], uint64_t pixels, int format) {
+	lua_createtable(L, 0, 6);
+	if (pixels == 0)
+		return;
+	double n = (double)pixels;
+	double mse;
+	if (format == FORMAT_RGBA8 || format == FORMAT_SRGBA8) {
+		mse = (err[0] + err[1] + err[2]) / (3 * n);
+		// the weights of calculateWeightedPSNR
+		double wmse = (0.299 * err[0] + 0.587 * err[1] + 0.114 * err[2]) / n;
+		set_number(L, "wmse", wmse);
+		set_number(L, "wpsnr", psnr(wmse));
+		set_number(L, "alpha_mse", err[3] / n);
+		set_number(L, "alpha_psnr", psnr(err[3] / n));
+	} else {
+		int channels = format_info[format].blocksize / 8;
+		mse = (channels == 1 ? err[0] : err[0] + err[1]) / (channels * n);
+	}
+	set_number(L, "mse", mse);
+	set_number(L, "psnr", psnr(mse));
+}
+
+static inline int
+sprite_field(lua_State *L, const char *key, int index, int id) {
+	if (lua_getfield(L, -1, key) != LUA_TNUMBER) {
+		return luaL_error(L, "Invalid .%s of sprite %d of source %d", key, index, id);
+	}
+	int v = (int)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return v;
+}
+
+// sprites of the source at the top of the stack, push { quality ... }
+static void
+sprite_quality(lua_State *L, const struct compress_source *src, int format, int id) {
+	const struct image *img = src->img;
+	int bw = (img->width + 3) / 4;
+	int n = (int)lua_rawlen(L, -1);
+	lua_createtable(L, n, 0);
 	int i;
-	for (i=0;i<16;i++) {
-		result[i*4+0] = img[i*3+0];
-		result[i*4+1] = img[i*3+1];
-		result[i*4+2] = img[i*3+2];
-		result[i*4+3] = alphaimg[i];
+	for (i=0;i<n;i++) {
+		lua_geti(L, -2, i+1);
+		if (!lua_istable(L, -1)) {
+			luaL_error(L, "Invalid sprite %d of source %d", i+1, id);
+		}
+		int x0 = sprite_field(L, "x", i+1, id);
+		int y0 = sprite_field(L, "y", i+1, id);
+		int x1 = x0 + sprite_field(L, "w", i+1, id);
+		int y1 = y0 + sprite_field(L, "h", i+1, id);
+		lua_pop(L, 1);
+		if (x0 < 0)
+			x0 = 0;
+		if (y0 < 0)
+			y0 = 0;
+		if (x1 > img->width)
+			x1 = img->width;
+		if (y1 > img->height)
+			y1 = img->height;
+		uint64_t err[4] = { 0, 0, 0, 0 };
+		uint64_t pixels = 0;
+		int x, y, c;
+		for (y=y0;y<y1;y++) {
+			for (x=x0;x<x1;x++) {
+				const uint8_t *d = src->diff + ((size_t)(y/4) * bw + x/4) * 64 + ((y%4)*4 + x%4)*4;
+				for (c=0;c<4;c++) {
+					err[c] += d[c] * d[c];
+				}
+				++pixels;
+			}
+		}
+		push_quality(L, err, pixels, format);
+		lua_seti(L, -2, i+1);
 	}
-	lua_pushlstring(L,(const char *)result, 16*4);
+}
+
+/*
+	table sources : { source ... }, each source is the same as compress (string or image), such as the levels of tbinpack.mipmap
+	string flag : see compress
+	integer threshold : see compress
+	integer threads (default 4)
+	string format (optional) : see compress
+	boolean/table metrics (optional) : true to measure the quality of each source,
+		or { sprites ... } , sprites[i] is nil or the sprites ({ x = , y = , w = , h = } ...) of source i (an image, the page)
 
+	return { string ... }, the blocks of all the sources are compressed in parallel
+		and { quality ... } if metrics is set, quality[i] is the quality of source i :
+		{ mse, psnr, wmse, wpsnr, alpha_mse, alpha_psnr, sprites = { quality ... } }
+			The errors are measured on the 8-bit pixels in the image (the padding of the blocks is ignored).
+			mse is for the rgb channels (or the r/rg channels of the 11-bit formats), wmse is weighted by 0.299 0.587 0.114 .
+			wmse and alpha are for rgba8/srgba8 only. psnr is inf if mse is 0.
+ */
+static int
+lcompress_batch(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	struct compress_option opt;
+	get_option(L, 2, &opt);
+	int threads = (int)luaL_optinteger(L, 4, 4);
+	opt.format = luaL_checkoption(L, 5, "rgba8", format_name);
+	setup_format(opt.format);
+	int metrics = lua_toboolean(L, 6);
+	int sprites = lua_istable(L, 6);
+	const int blocksize = format_info[opt.format].blocksize;
+	int n = (int)lua_rawlen(L, 1);
+	lua_settop(L, 6);
+	struct compress_source * source = (struct compress_source *)lua_newuserdata(L, n * sizeof(*source));
+	size_t total = 0;
+	size_t total_diff = 0;
+	int njob = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		int id = i + 1;
+		lua_geti(L, 1, id);
+		// sources are referenced by the table
+		struct image *img = image_test(L, -1);
+		source[i].img = img;
+		source[i].diff = NULL;
+		if (img) {
+			source[i].data = img->data;
+			source[i].n = (size_t)((img->width + 3) / 4) * ((img->height + 3) / 4);
+		} else {
+			size_t sz = 0;
+			const char *data = lua_tolstring(L, -1, &sz);
+			if (data == NULL || sz == 0 || sz % (16*4) != 0) {
+				return luaL_error(L, "Not 4x4 RGBA block at index %d", id);
+			}
+			source[i].data = (const uint8_t *)data;
+			source[i].n = sz / (16*4);
+		}
+		lua_pop(L, 1);
+		if (sprites && lua_geti(L, 6, id) != LUA_TNIL) {
+			if (img == NULL || !lua_istable(L, -1)) {
+				return luaL_error(L, "The sprites of source %d need a table and an image source", id);
+			}
+			total_diff += source[i].n;
+		}
+		if (sprites)
+			lua_pop(L, 1);
+		total += source[i].n;
+		njob += (int)((source[i].n + BATCH_BLOCKS - 1) / BATCH_BLOCKS);
+	}
+	uint8_t * output = (uint8_t *)lua_newuserdata(L, total * blocksize);
+	struct compress_job * job = (struct compress_job *)lua_newuserdata(L, njob * sizeof(*job));
+	uint8_t * diff = sprites ? (uint8_t *)lua_newuserdata(L, total_diff * 64) : NULL;
+	int j = 0;
+	for (i=0;i<n;i++) {
+		source[i].output = output;
+		output += source[i].n * blocksize;
+		if (sprites) {
+			if (lua_geti(L, 6, i+1) != LUA_TNIL) {
+				source[i].diff = diff;
+				diff += source[i].n * 64;
+			}
+			lua_pop(L, 1);
+		}
+		size_t from;
+		for (from=0;from<source[i].n;from+=BATCH_BLOCKS) {
+			struct compress_job *jb = &job[j++];
+			jb->source = &source[i];
+			jb->opt = &opt;
+			jb->blocksize = blocksize;
+			jb->metrics = metrics;
+			jb->from = from;
+			jb->to = from + BATCH_BLOCKS < source[i].n ? from + BATCH_BLOCKS : source[i].n;
+			memset(jb->err, 0, sizeof(jb->err));
+		}
+	}
+	thread_run(threads, compress_batch_job, job, njob);
+	lua_createtable(L, n, 0);
+	for (i=0;i<n;i++) {
+		lua_pushlstring(L, (const char *)source[i].output, source[i].n * blocksize);
+		lua_seti(L, -2, i+1);
+	}
+	if (!metrics)
+		return 1;
+	lua_createtable(L, n, 0);
+	j = 0;
+	for (i=0;i<n;i++) {
+		uint64_t err[4] = { 0, 0, 0, 0 };
+		for (;j<njob && job[j].source == &source[i];j++) {
+			int c;
+			for (c=0;c<4;c++) {
+				err[c] += job[j].err[c];
+			}
+		}
+		const struct image *img = source[i].img;
+		uint64_t pixels = img ? (uint64_t)img->width * img->height : (uint64_t)source[i].n * 16;
+		push_quality(L, err, pixels, opt.format);
+		if (source[i].diff) {
+			lua_geti(L, 6, i+1);
+			sprite_quality(L, &source[i], opt.format, i+1);
+			lua_setfield(L, -3, "sprites");
+			lua_pop(L, 1);
+		}
+		lua_seti(L, -2, i+1);
+	}
+	return 2;
+}
+
+static void
+ktx_uint32(luaL_Buffer *b, unsigned int v) {
+	luaL_addlstring(b, (const char *)&v, 4);
+}
+
+/*
+	integer width
+	integer height
+	table levels : { string ... }, the compressed levels (from compress or compress_batch), level i is (width >> i) x (height >> i)
+	string format (optional) : see compress, default rgba8 (glInternalFormat is COMPRESSED_RGBA8_ETC2_EAC)
+
+	return string of KTX (version 1) file
+ */
+static int
+lktx(lua_State *L) {
+	int width = (int)luaL_checkinteger(L, 1);
+	int height = (int)luaL_checkinteger(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	int levels = (int)lua_rawlen(L, 3);
+	int format = luaL_checkoption(L, 4, "rgba8", format_name);
+	if (width <= 0 || height <= 0 || levels <= 0) {
+		return luaL_error(L, "Invalid size %dx%d (%d levels)", width, height, levels);
+	}
+	static const uint8_t identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	luaL_addlstring(&b, (const char *)identifier, sizeof(identifier));
+	ktx_uint32(&b, 0x04030201);	// endianness
+	ktx_uint32(&b, 0);	// glType
+	ktx_uint32(&b, 1);	// glTypeSize
+	ktx_uint32(&b, 0);	// glFormat
+	ktx_uint32(&b, format_info[format].internalformat);
+	ktx_uint32(&b, format_info[format].baseformat);
+	ktx_uint32(&b, width);
+	ktx_uint32(&b, height);
+	ktx_uint32(&b, 0);	// pixelDepth
+	ktx_uint32(&b, 0);	// numberOfArrayElements
+	ktx_uint32(&b, 1);	// numberOfFaces
+	ktx_uint32(&b, levels);
+	ktx_uint32(&b, 0);	// bytesOfKeyValueData
+	int i;
+	for (i=0;i<levels;i++) {
+		int w = width >> i;
+		int h = height >> i;
+		if (w < 1)
+			w = 1;
+		if (h < 1)
+			h = 1;
+		size_t expect = (size_t)((w + 3) / 4) * ((h + 3) / 4) * format_info[format].blocksize;
+		lua_geti(L, 3, i+1);
+		size_t sz = 0;
+		const char * data = lua_tolstring(L, -1, &sz);
+		if (data == NULL || sz != expect) {
+			return luaL_error(L, "Invalid level %d (%dx%d), size %d should be %d", i, w, h, (int)sz, (int)expect);
+		}
+		// keep the stack balanced for the buffer, the string is still referenced by levels
+		lua_pop(L, 1);
+		ktx_uint32(&b, (unsigned int)sz);
+		luaL_addlstring(&b, data, sz);	// the size is a multiple of 4, no padding
+	}
+	luaL_pushresult(&b);
 	return 1;
 }
 
@@ -139,6 +1406,8 @@ luaopen_etc2codec(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "compress", lcompress },
 		{ "uncompress", luncompress },
+		{ "compress_batch", lcompress_batch },
+		{ "ktx", lktx },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
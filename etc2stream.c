@@ -0,0 +1,918 @@
+#include <stdint.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+	etc2pack stream : the data of blocks, follows by the descriptions (2 bits per block).
+	One byte store 4 blocks description from low bits to high bits, row-major order.
+
+	00 : empty (all alpha are 0), no data
+	10 : opaque (all alpha are 255), 64bit color
+	11 : RGBA, 64bit alpha + 64bit color
+	01 : extended (only if etc2pack is called with extended), a tag byte follows
+		tag 0 : reference, varint distance (in blocks) to an earlier identical block, which is never a reference
+		tag 1 : uniform alpha, alpha byte + 64bit color
+ */
+
+#define ETC2_EMPTY 0	// 00
+#define ETC2_EXTENDED 1	// 01
+#define ETC2_OPAQUE 2	// 10
+#define ETC2_RGBA 3	// 11
+
+#define ETC2_TAG_REFERENCE 0
+#define ETC2_TAG_ALPHA 1
+
+#define ETC2_MAX_BLOCKS 0x3fffffff	// the block count is an int, and the dedup table has 2n slots
+
+static const int etc2_block_size[4] = { 0, 0, 8, 16 };	// size of extended blocks depends on the tag
+
+// classify the etc2 block by its 64bit alpha
+static inline int
+etc2_classify(const uint8_t *block) {
+#if defined(__SSE2__)
+	__m128i alpha = _mm_loadl_epi64((const __m128i *)block);
+	int zero = _mm_movemask_epi8(_mm_cmpeq_epi8(alpha, _mm_setzero_si128())) & 0xff;
+	if (zero == 0xff)
+		return ETC2_EMPTY;
+	// base 255, multiplier 0 : all the alpha are 255
+	if (zero == 0xfe && block[0] == 255)
+		return ETC2_OPAQUE;
+	return ETC2_RGBA;
+#else
+	static const uint8_t c_zero[8] = { 0,0,0,0,0,0,0,0 };
+	static const uint8_t c_one[8] = { 255,0,0,0,0,0,0,0 };
+	if (memcmp(c_zero, block, 8) == 0)
+		return ETC2_EMPTY;
+	if (memcmp(c_one, block, 8) == 0)
+		return ETC2_OPAQUE;
+	return ETC2_RGBA;
+#endif
+}
+
+// base a, multiplier 0 : all the alpha are a
+static inline int
+uniform_alpha(const uint8_t *block) {
+	static const uint8_t c_zero[7] = { 0,0,0,0,0,0,0 };
+	return memcmp(block + 1, c_zero, 7) == 0;
+}
+
+static inline int
+varint_size(uint32_t v) {
+	int n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		++n;
+	}
+	return n;
+}
+
+static inline uint8_t *
+varint_write(uint8_t *ptr, uint32_t v) {
+	while (v >= 0x80) {
+		*ptr++ = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	*ptr++ = (uint8_t)v;
+	return ptr;
+}
+
+static inline uint32_t
+block_hash(const uint8_t *block) {
+	uint64_t a, b;
+	memcpy(&a, block, 8);
+	memcpy(&b, block + 8, 8);
+	uint64_t h = (a ^ (b * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+	return (uint32_t)(h >> 32);
+}
+
+struct dedup {
+	int *slot;	// block index + 1, 0 for empty slot
+	uint32_t mask;
+};
+
+// return the index of an earlier identical block, or -1 (and remember block i)
+static int
+dedup_find(struct dedup *d, const uint8_t *blocks, int i) {
+	const uint8_t * block = blocks + i * 16;
+	uint32_t h = block_hash(block) & d->mask;
+	for (;;) {
+		int k = d->slot[h];
+		if (k == 0) {
+			d->slot[h] = i + 1;
+			return -1;
+		}
+		if (memcmp(blocks + (k - 1) * 16, block, 16) == 0) {
+			return k - 1;
+		}
+		h = (h + 1) & d->mask;
+	}
+}
+
+// classify all the blocks into desc (2 bits per block), and the reference distance into ref. return the size of block data
+static size_t
+etc2_classify_blocks(const uint8_t *blocks, int n, uint8_t *desc, uint32_t *ref, struct dedup *d) {
+	size_t sz = 0;
+	int i;
+	memset(desc, 0, ((size_t)n + 3) / 4);
+	for (i=0;i<n;i++) {
+		const uint8_t * block = blocks + i * 16;
+		int type = etc2_classify(block);
+		int size = etc2_block_size[type];
+		if (d && type != ETC2_EMPTY) {
+			ref[i] = 0;
+			if (type == ETC2_RGBA && uniform_alpha(block)) {
+				type = ETC2_EXTENDED;
+				size = 2 + 8;
+			}
+			int k = dedup_find(d, blocks, i);
+			if (k >= 0) {
+				uint32_t distance = i - k;
+				int ref_size = 1 + varint_size(distance);
+				if (ref_size < size) {
+					type = ETC2_EXTENDED;
+					size = ref_size;
+					ref[i] = distance;
+				} else {
+					// a nearer original for the following blocks
+					uint32_t h = block_hash(block) & d->mask;
+					while (d->slot[h] != k + 1)
+						h = (h + 1) & d->mask;
+					d->slot[h] = i + 1;
+				}
+			}
+		}
+		desc[i/4] |= type << ((i & 3) * 2);
+		sz += size;
+	}
+	return sz;
+}
+
+/*
+	table of etc2 blocks (16 bytes string per block), or a string of n blocks (n * 16 bytes, as etc2codec.compress)
+	boolean extended : use the extended blocks (references to identical blocks and uniform alpha blocks)
+
+	return etc2pack stream
+ */
+int
+etc2stream_pack(lua_State *L) {
+	const uint8_t * blocks;
+	int n;
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		size_t sz;
+		blocks = (const uint8_t *)lua_tolstring(L, 1, &sz);
+		if (sz % 16 != 0 || sz / 16 > ETC2_MAX_BLOCKS) {
+			return luaL_error(L, "Invalid etc2 blocks length %d", (int)sz);
+		}
+		n = (int)(sz / 16);
+	} else {
+		// gather the blocks into one buffer
+		luaL_checktype(L, 1, LUA_TTABLE);
+		size_t len = lua_rawlen(L, 1);
+		if (len > ETC2_MAX_BLOCKS) {
+			return luaL_error(L, "Too many etc2 blocks (%I)", (lua_Integer)len);
+		}
+		n = (int)len;
+		uint8_t * tmp = lua_newuserdata(L, (size_t)n * 16);
+		int i;
+		for (i = 0; i < n; i++) {
+			lua_geti(L, 1, i+1);
+			size_t sz;
+			const char * block = luaL_checklstring(L, -1, &sz);
+			if (sz != 16) {
+				return luaL_error(L, "Invalid etc2 block length at index %d", i+1);
+			}
+			memcpy(tmp + i * 16, block, 16);
+			lua_pop(L, 1);
+		}
+		blocks = tmp;
+	}
+	int extended = lua_toboolean(L, 2);
+	size_t desc_len = ((size_t)n + 3) / 4;
+	uint8_t * desc = lua_newuserdata(L, desc_len);
+	uint32_t * ref = NULL;
+	struct dedup d;
+	if (extended) {
+		uint32_t cap = 16;
+		while (cap < (uint32_t)n * 2)
+			cap *= 2;
+		ref = lua_newuserdata(L, (size_t)n * sizeof(uint32_t) + cap * sizeof(int));
+		d.slot = (int *)(ref + n);
+		d.mask = cap - 1;
+		memset(d.slot, 0, cap * sizeof(int));
+	}
+	size_t sz = etc2_classify_blocks(blocks, n, desc, ref, extended ? &d : NULL);
+	luaL_Buffer b;
+	uint8_t * output = (uint8_t *)luaL_buffinitsize(L, &b, sz + desc_len);
+	uint8_t * ptr = output;
+	int i;
+	for (i = 0; i < n; i++) {
+		const uint8_t * block = blocks + i * 16;
+		switch ((desc[i/4] >> ((i & 3) * 2)) & 3) {
+		case ETC2_OPAQUE:
+			memcpy(ptr, block+8, 8);	// write 64bit color only
+			ptr += 8;
+			break;
+		case ETC2_RGBA:
+			memcpy(ptr, block, 16);	// write 64bit color + 64bit alpha
+			ptr += 16;
+			break;
+		case ETC2_EXTENDED:
+			if (ref[i]) {
+				*ptr++ = ETC2_TAG_REFERENCE;
+				ptr = varint_write(ptr, ref[i]);
+			} else {
+				*ptr++ = ETC2_TAG_ALPHA;
+				*ptr++ = block[0];
+				memcpy(ptr, block+8, 8);
+				ptr += 8;
+			}
+			break;
+		}
+	}
+	memcpy(ptr, desc, desc_len);
+	luaL_pushresultsize(&b, sz + desc_len);
+	return 1;
+}
+
+struct etc2stream {
+	const uint8_t *data;
+	size_t data_len;
+	const uint8_t *desc;
+	int n;
+	const uint32_t *index;	// can be NULL
+	int interval;
+};
+
+static void
+etc2_stream(lua_State *L, int index, int n, struct etc2stream *s) {
+	size_t sz;
+	const uint8_t * stream = (const uint8_t *)luaL_checklstring(L, index, &sz);
+	if (n < 0 || n > ETC2_MAX_BLOCKS) {
+		luaL_error(L, "Invalid etc2pack stream for %d blocks", n);
+	}
+	size_t desc_len = ((size_t)n + 3) / 4;
+	if (sz < desc_len) {
+		luaL_error(L, "Invalid etc2pack stream for %d blocks", n);
+	}
+	s->data = stream;
+	s->data_len = sz - desc_len;
+	s->desc = stream + s->data_len;
+	s->n = n;
+	s->index = NULL;
+	s->interval = 0;
+}
+
+static inline int
+etc2_type(const struct etc2stream *s, int i) {
+	return (s->desc[i/4] >> ((i & 3) * 2)) & 3;
+}
+
+static uint32_t
+varint_read(lua_State *L, const struct etc2stream *s, size_t *offset) {
+	uint32_t v = 0;
+	int shift = 0;
+	for (;;) {
+		if (*offset >= s->data_len || shift > 28) {
+			luaL_error(L, "Invalid etc2pack stream, bad varint");
+		}
+		uint8_t c = s->data[(*offset)++];
+		v |= (uint32_t)(c & 0x7f) << shift;
+		if (c < 0x80)
+			return v;
+		shift += 7;
+	}
+}
+
+static inline void
+check_data(lua_State *L, const struct etc2stream *s, size_t offset, size_t sz, int i) {
+	if (offset + sz > s->data_len) {
+		luaL_error(L, "Invalid etc2pack stream at block %d", i);
+	}
+}
+
+// size of an extended block at offset
+static size_t
+extended_size(lua_State *L, const struct etc2stream *s, size_t offset, int i) {
+	check_data(L, s, offset, 1, i);
+	switch (s->data[offset]) {
+	case ETC2_TAG_REFERENCE: {
+		size_t p = offset + 1;
+		varint_read(L, s, &p);
+		return p - offset;
+	}
+	case ETC2_TAG_ALPHA:
+		return 2 + 8;
+	default:
+		luaL_error(L, "Invalid etc2pack stream, unknown tag %d at block %d", s->data[offset], i);
+		return 0;
+	}
+}
+
+// skip the blocks [from, to) at data offset, return the offset after them
+static size_t
+etc2_skip(lua_State *L, const struct etc2stream *s, int from, int to, size_t offset) {
+	static uint8_t desc_size[256];	// data size of 4 blocks for each desc byte without extended blocks
+	if (desc_size[255] == 0) {
+		int i;
+		for (i=0;i<256;i++) {
+			desc_size[i] = etc2_block_size[i & 3] + etc2_block_size[(i >> 2) & 3] + etc2_block_size[(i >> 4) & 3] + etc2_block_size[i >> 6];
+		}
+	}
+	while (from < to) {
+		if ((from & 3) == 0 && from + 4 <= to) {
+			uint8_t d = s->desc[from/4];
+			if ((d & ~(d >> 1) & 0x55) == 0) {
+				// no 01 in this byte
+				offset += desc_size[d];
+				from += 4;
+				continue;
+			}
+		}
+		int type = etc2_type(s, from);
+		if (type == ETC2_EXTENDED) {
+			offset += extended_size(L, s, offset, from);
+		} else {
+			offset += etc2_block_size[type];
+		}
+		++from;
+	}
+	check_data(L, s, offset, 0, to);
+	return offset;
+}
+
+static size_t etc2_decode(lua_State *L, const struct etc2stream *s, int i, size_t offset, uint8_t *output, const uint8_t *run, int run_from);
+
+// decode block i alone, it's the target of a reference, so it should not be a reference
+static void
+etc2_lookup(lua_State *L, const struct etc2stream *s, int i, uint8_t *output) {
+	int start = 0;
+	size_t offset = 0;
+	if (s->index) {
+		int k = i / s->interval;
+		start = k * s->interval;
+		offset = s->index[k+1];
+	}
+	offset = etc2_skip(L, s, start, i, offset);
+	if (etc2_type(s, i) == ETC2_EXTENDED) {
+		check_data(L, s, offset, 1, i);
+		if (s->data[offset] == ETC2_TAG_REFERENCE)
+			luaL_error(L, "Invalid etc2pack stream, reference to reference at block %d", i);
+	}
+	etc2_decode(L, s, i, offset, output, NULL, 0);
+}
+
+// decode block i at data offset into output (16 bytes), return the offset after it.
+// run is the output of blocks [run_from, i), for resolving the references.
+static size_t
+etc2_decode(lua_State *L, const struct etc2stream *s, int i, size_t offset, uint8_t *output, const uint8_t *run, int run_from) {
+	static const uint8_t c_one[8] = { 255,0,0,0,0,0,0,0 };
+	int type = etc2_type(s, i);
+	switch (type) {
+	case ETC2_OPAQUE:
+		check_data(L, s, offset, 8, i);
+		memcpy(output, c_one, 8);
+		memcpy(output + 8, s->data + offset, 8);
+		return offset + 8;
+	case ETC2_RGBA:
+		check_data(L, s, offset, 16, i);
+		memcpy(output, s->data + offset, 16);
+		return offset + 16;
+	case ETC2_EXTENDED: {
+		size_t sz = extended_size(L, s, offset, i);
+		check_data(L, s, offset, sz, i);
+		if (s->data[offset] == ETC2_TAG_ALPHA) {
+			memset(output, 0, 8);
+			output[0] = s->data[offset + 1];
+			memcpy(output + 8, s->data + offset + 2, 8);
+		} else {
+			size_t p = offset + 1;
+			uint32_t distance = varint_read(L, s, &p);
+			if (distance == 0 || distance > (uint32_t)i) {
+				luaL_error(L, "Invalid etc2pack stream, bad reference at block %d", i);
+			}
+			int target = i - distance;
+			if (run && target >= run_from) {
+				memcpy(output, run + (size_t)(target - run_from) * 16, 16);
+			} else {
+				etc2_lookup(L, s, target, output);
+			}
+		}
+		return offset + sz;
+	}
+	default:
+		memset(output, 0, 16);
+		return offset;
+	}
+}
+
+/*
+	string stream (output of etc2pack)
+	integer n (number of blocks)
+	integer interval (optional, default 256, should be multiple of 4)
+
+	return index string : uint32 interval, then uint32 data offset of block k * interval.
+	It's used by etc2unpack to decode a sub rect without scanning the whole stream.
+ */
+int
+etc2stream_index(lua_State *L) {
+	int n = luaL_checkinteger(L, 2);
+	struct etc2stream s;
+	etc2_stream(L, 1, n, &s);
+	int interval = luaL_optinteger(L, 3, 256);
+	if (interval <= 0 || interval % 4 != 0) {
+		return luaL_error(L, "Invalid interval %d", interval);
+	}
+	int count = (n + interval - 1) / interval;
+	luaL_Buffer b;
+	uint32_t * index = (uint32_t *)luaL_buffinitsize(L, &b, (count + 1) * sizeof(uint32_t));
+	index[0] = interval;
+	size_t offset = 0;
+	int i;
+	for (i=0;i<count;i++) {
+		index[i+1] = (uint32_t)offset;
+		int to = (i+1) * interval;
+		if (to > n)
+			to = n;
+		offset = etc2_skip(L, &s, i * interval, to, offset);
+	}
+	luaL_pushresultsize(&b, (count + 1) * sizeof(uint32_t));
+	return 1;
+}
+
+/*
+	string stream (output of etc2pack)
+	integer n (number of blocks)
+	string index (optional, output of etc2index)
+	integer pitch (blocks per row)
+	integer x, y, w, h (sub rect in blocks)
+
+	return ETC2 RGBA blocks (16 bytes per block) of all the blocks, or the sub rect (row-major) if index is given.
+ */
+int
+etc2stream_unpack(lua_State *L) {
+	int n = luaL_checkinteger(L, 2);
+	struct etc2stream s;
+	etc2_stream(L, 1, n, &s);
+	luaL_Buffer b;
+	int i;
+	if (lua_isnoneornil(L, 3)) {
+		uint8_t * output = (uint8_t *)luaL_buffinitsize(L, &b, (size_t)n * 16);
+		size_t offset = 0;
+		for (i=0;i<n;i++) {
+			offset = etc2_decode(L, &s, i, offset, output + (size_t)i * 16, output, 0);
+		}
+		if (offset != s.data_len) {
+			return luaL_error(L, "Invalid etc2pack stream for %d blocks", n);
+		}
+		luaL_pushresultsize(&b, (size_t)n * 16);
+		return 1;
+	}
+	size_t index_sz;
+	const uint32_t * index = (const uint32_t *)luaL_checklstring(L, 3, &index_sz);
+	int pitch = luaL_checkinteger(L, 4);
+	int x = luaL_checkinteger(L, 5);
+	int y = luaL_checkinteger(L, 6);
+	int w = luaL_checkinteger(L, 7);
+	int h = luaL_checkinteger(L, 8);
+	if (index_sz < sizeof(uint32_t) || index_sz % sizeof(uint32_t) != 0) {
+		return luaL_error(L, "Invalid etc2 index");
+	}
+	int interval = index[0];
+	int count = index_sz / sizeof(uint32_t) - 1;
+	if (interval <= 0 || count != (n + interval - 1) / interval) {
+		return luaL_error(L, "Invalid etc2 index for %d blocks", n);
+	}
+	if (x < 0 || y < 0 || w < 0 || h < 0 || x + w > pitch || (size_t)(y + h) * pitch > (size_t)n) {
+		return luaL_error(L, "Invalid rect (%dx%d %d,%d) for %d blocks (pitch %d)", w, h, x, y, n, pitch);
+	}
+	s.index = index;
+	s.interval = interval;
+	uint8_t * output = (uint8_t *)luaL_buffinitsize(L, &b, (size_t)w * h * 16);
+	for (i=0;i<h;i++) {
+		int from = (y + i) * pitch + x;
+		int k = from / interval;
+		size_t offset = etc2_skip(L, &s, k * interval, from, index[k+1]);
+		uint8_t * row = output + (size_t)i * w * 16;
+		int j;
+		for (j=0;j<w;j++) {
+			offset = etc2_decode(L, &s, from + j, offset, row + j * 16, row, from);
+		}
+	}
+	luaL_pushresultsize(&b, (size_t)w * h * 16);
+	return 1;
+}
+
+/*
+	Supercompression of etc2pack stream.
+	The stream is split into planes, endpoints and selectors are separated, and the bytes of the records are transposed
+	(all the first bytes, then all the second bytes ...), so that each plane compresses well by LZ.
+
+	header : uint32 n (number of blocks), then uint32 raw size and uint32 compressed size for each plane
+	the compressed planes follow the header, a plane is stored as it is if the compressed size equals the raw size.
+ */
+
+#define PLANE_DESC 0
+#define PLANE_EXT 1	// tags, varints and uniform alpha of the extended blocks
+#define PLANE_ALPHA_ENDPOINT 2	// base, multiplier and table
+#define PLANE_ALPHA_SELECTOR 3
+#define PLANE_COLOR_ENDPOINT 4	// the first 32bit of color block
+#define PLANE_COLOR_SELECTOR 5	// the second 32bit of color block
+#define PLANE_N 6
+
+#define LZ_MINMATCH 4
+#define LZ_HASHBITS 14
+#define LZ_MAXOFFSET 65535
+
+static inline size_t
+lz_bound(size_t n) {
+	return n + n / 255 + 16;
+}
+
+static inline uint8_t *
+lz_length(uint8_t *p, size_t len) {
+	while (len >= 255) {
+		*p++ = 255;
+		len -= 255;
+	}
+	*p++ = (uint8_t)len;
+	return p;
+}
+
+static inline uint8_t *
+lz_literal(uint8_t *p, const uint8_t *src, size_t lit, int matchlen) {
+	*p++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4 | matchlen);
+	if (lit >= 15)
+		p = lz_length(p, lit - 15);
+	memcpy(p, src, lit);
+	return p + lit;
+}
+
+// LZ4 like format : token (4bit literal length, 4bit match length - 4), literals, 16bit offset, the last sequence has literals only
+static size_t
+lz_compress(const uint8_t *src, size_t n, uint8_t *dst, uint32_t *hash) {
+	uint8_t *p = dst;
+	size_t anchor = 0;
+	size_t i = 0;
+	memset(hash, 0, sizeof(uint32_t) << LZ_HASHBITS);
+	while (i + LZ_MINMATCH <= n) {
+		uint32_t v;
+		memcpy(&v, src + i, 4);
+		uint32_t h = (v * 2654435761u) >> (32 - LZ_HASHBITS);
+		size_t ref = hash[h];	// position + 1
+		hash[h] = (uint32_t)(i + 1);
+		if (ref == 0 || i - (ref - 1) > LZ_MAXOFFSET || memcmp(src + ref - 1, src + i, 4) != 0) {
+			++i;
+			continue;
+		}
+		--ref;
+		size_t len = LZ_MINMATCH;
+		while (i + len < n && src[ref + len] == src[i + len])
+			++len;
+		size_t ml = len - LZ_MINMATCH;
+		p = lz_literal(p, src + anchor, i - anchor, ml >= 15 ? 15 : ml);
+		size_t offset = i - ref;
+		p[0] = (uint8_t)offset;
+		p[1] = (uint8_t)(offset >> 8);
+		p += 2;
+		if (ml >= 15)
+			p = lz_length(p, ml - 15);
+		i += len;
+		anchor = i;
+	}
+	p = lz_literal(p, src + anchor, n - anchor, 0);
+	return p - dst;
+}
+
+static inline int
+lz_readlength(const uint8_t **src, const uint8_t *end, size_t *len) {
+	uint8_t c;
+	do {
+		if (*src >= end)
+			return 1;
+		c = *(*src)++;
+		*len += c;
+	} while (c == 255);
+	return 0;
+}
+
+// return 0 if succ
+static int
+lz_decompress(const uint8_t *src, size_t sn, uint8_t *dst, size_t dn) {
+	const uint8_t *end = src + sn;
+	size_t o = 0;
+	while (src < end) {
+		int token = *src++;
+		size_t lit = token >> 4;
+		if (lit == 15 && lz_readlength(&src, end, &lit))
+			return 1;
+		if (lit > (size_t)(end - src) || lit > dn - o)
+			return 1;
+		memcpy(dst + o, src, lit);
+		src += lit;
+		o += lit;
+		if (src == end)
+			break;
+		if (end - src < 2)
+			return 1;
+		size_t offset = src[0] | src[1] << 8;
+		src += 2;
+		size_t len = token & 15;
+		if (len == 15 && lz_readlength(&src, end, &len))
+			return 1;
+		len += LZ_MINMATCH;
+		if (offset == 0 || offset > o || len > dn - o)
+			return 1;
+		uint8_t *d = dst + o;
+		const uint8_t *s = d - offset;
+		if (offset >= len) {
+			memcpy(d, s, len);
+		} else {
+			size_t k;
+			for (k=0;k<len;k++)
+				d[k] = s[k];
+		}
+		o += len;
+	}
+	return o != dn;
+}
+
+struct planes {
+	uint8_t *ptr[PLANE_N];
+	size_t size[PLANE_N];
+	size_t count[PLANE_N];	// records
+};
+
+// write the record into the transposed plane
+static inline void
+plane_write(struct planes *p, int plane, const uint8_t *record, int sz) {
+	size_t i = p->count[plane]++;
+	size_t n = p->size[plane] / sz;
+	int j;
+	for (j=0;j<sz;j++) {
+		p->ptr[plane][j * n + i] = record[j];
+	}
+}
+
+static inline void
+plane_read(struct planes *p, int plane, uint8_t *record, int sz) {
+	size_t i = p->count[plane]++;
+	size_t n = p->size[plane] / sz;
+	int j;
+	for (j=0;j<sz;j++) {
+		record[j] = p->ptr[plane][j * n + i];
+	}
+}
+
+// split the blocks of etc2pack stream into planes, count the size only if p->ptr[0] is NULL
+static void
+split_planes(lua_State *L, const struct etc2stream *s, struct planes *p) {
+	int count = p->ptr[0] == NULL;
+	if (!count) {
+		memcpy(p->ptr[PLANE_DESC], s->desc, p->size[PLANE_DESC]);
+		memset(p->count, 0, sizeof(p->count));
+	}
+	size_t offset = 0;
+	size_t ext = 0;
+	int i;
+	for (i=0;i<s->n;i++) {
+		int type = etc2_type(s, i);
+		const uint8_t * color = NULL;
+		switch (type) {
+		case ETC2_EMPTY:
+			break;
+		case ETC2_OPAQUE:
+			check_data(L, s, offset, 8, i);
+			color = s->data + offset;
+			offset += 8;
+			break;
+		case ETC2_RGBA:
+			check_data(L, s, offset, 16, i);
+			if (count) {
+				p->size[PLANE_ALPHA_ENDPOINT] += 2;
+				p->size[PLANE_ALPHA_SELECTOR] += 6;
+			} else {
+				plane_write(p, PLANE_ALPHA_ENDPOINT, s->data + offset, 2);
+				plane_write(p, PLANE_ALPHA_SELECTOR, s->data + offset + 2, 6);
+			}
+			color = s->data + offset + 8;
+			offset += 16;
+			break;
+		case ETC2_EXTENDED: {
+			size_t sz = extended_size(L, s, offset, i);
+			check_data(L, s, offset, sz, i);
+			if (s->data[offset] == ETC2_TAG_ALPHA) {
+				// tag and alpha
+				sz = 2;
+				color = s->data + offset + 2;
+			}
+			if (!count)
+				memcpy(p->ptr[PLANE_EXT] + ext, s->data + offset, sz);
+			ext += sz;
+			offset += color ? 2 + 8 : sz;
+			break;
+		}
+		}
+		if (color) {
+			if (count) {
+				p->size[PLANE_COLOR_ENDPOINT] += 4;
+				p->size[PLANE_COLOR_SELECTOR] += 4;
+			} else {
+				plane_write(p, PLANE_COLOR_ENDPOINT, color, 4);
+				plane_write(p, PLANE_COLOR_SELECTOR, color + 4, 4);
+			}
+		}
+	}
+	if (offset != s->data_len) {
+		luaL_error(L, "Invalid etc2pack stream for %d blocks", s->n);
+	}
+	p->size[PLANE_EXT] = ext;
+}
+
+/*
+	string stream (output of etc2pack)
+	integer n (number of blocks)
+
+	return supercompressed stream, use etc2decompress to get the blocks
+ */
+int
+etc2stream_compress(lua_State *L) {
+	int n = luaL_checkinteger(L, 2);
+	struct etc2stream s;
+	etc2_stream(L, 1, n, &s);
+	struct planes p;
+	memset(&p, 0, sizeof(p));
+	p.size[PLANE_DESC] = ((size_t)n + 3) / 4;
+	split_planes(L, &s, &p);
+	size_t raw = 0;
+	size_t bound = 0;
+	int i;
+	for (i=0;i<PLANE_N;i++) {
+		raw += p.size[i];
+		bound += lz_bound(p.size[i]);
+	}
+	uint8_t * tmp = lua_newuserdata(L, raw + (sizeof(uint32_t) << LZ_HASHBITS));
+	uint32_t * hash = (uint32_t *)tmp;
+	tmp += sizeof(uint32_t) << LZ_HASHBITS;
+	for (i=0;i<PLANE_N;i++) {
+		p.ptr[i] = tmp;
+		tmp += p.size[i];
+	}
+	split_planes(L, &s, &p);
+
+	size_t header = (1 + PLANE_N * 2) * sizeof(uint32_t);
+	luaL_Buffer b;
+	uint8_t * output = (uint8_t *)luaL_buffinitsize(L, &b, header + bound);
+	uint32_t * h = (uint32_t *)output;
+	uint8_t * ptr = output + header;
+	h[0] = n;
+	for (i=0;i<PLANE_N;i++) {
+		size_t sz = lz_compress(p.ptr[i], p.size[i], ptr, hash);
+		if (sz >= p.size[i]) {
+			// store
+			memcpy(ptr, p.ptr[i], p.size[i]);
+			sz = p.size[i];
+		}
+		h[1 + i*2] = (uint32_t)p.size[i];
+		h[2 + i*2] = (uint32_t)sz;
+		ptr += sz;
+	}
+	luaL_pushresultsize(&b, ptr - output);
+	return 1;
+}
+
+/*
+	string supercompressed stream (output of etc2compress)
+	userdata buffer (optional, at least n * 16 bytes, a plain userdata without metatable, not an image)
+
+	Decode the ETC2 RGBA blocks (16 bytes per block) into the buffer (for uploading to GPU directly), or return a string.
+	return n (number of blocks), blocks (if no buffer)
+ */
+int
+etc2stream_decompress(lua_State *L) {
+	size_t sz;
+	const uint8_t * data = (const uint8_t *)luaL_checklstring(L, 1, &sz);
+	size_t header = (1 + PLANE_N * 2) * sizeof(uint32_t);
+	if (sz < header) {
+		return luaL_error(L, "Invalid etc2 supercompressed stream");
+	}
+	const uint32_t * h = (const uint32_t *)data;
+	if (h[0] > ETC2_MAX_BLOCKS) {
+		return luaL_error(L, "Invalid etc2 supercompressed stream");
+	}
+	int n = (int)h[0];
+	struct planes p;
+	size_t raw = 0;
+	size_t packed = header;
+	int i;
+	for (i=0;i<PLANE_N;i++) {
+		p.size[i] = h[1 + i*2];
+		p.count[i] = 0;
+		raw += p.size[i];
+		packed += h[2 + i*2];
+	}
+	if (packed != sz || p.size[PLANE_DESC] != ((size_t)n + 3) / 4
+		|| p.size[PLANE_ALPHA_ENDPOINT] % 2 != 0 || p.size[PLANE_ALPHA_ENDPOINT] / 2 * 6 != p.size[PLANE_ALPHA_SELECTOR]
+		|| p.size[PLANE_COLOR_ENDPOINT] % 4 != 0 || p.size[PLANE_COLOR_ENDPOINT] != p.size[PLANE_COLOR_SELECTOR]) {
+		return luaL_error(L, "Invalid etc2 supercompressed stream");
+	}
+	uint8_t * output;
+	if (lua_isnoneornil(L, 2)) {
+		output = NULL;
+	} else {
+		luaL_checktype(L, 2, LUA_TUSERDATA);
+		// a plain buffer only, the userdata with a metatable (such as an image) has its own layout
+		if (lua_getmetatable(L, 2)) {
+			return luaL_error(L, "The buffer should be a userdata without metatable");
+		}
+		if (lua_rawlen(L, 2) < (size_t)n * 16) {
+			return luaL_error(L, "The buffer is too small (%I < %I)", (lua_Integer)lua_rawlen(L, 2), (lua_Integer)n * 16);
+		}
+		output = (uint8_t *)lua_touserdata(L, 2);
+	}
+	uint8_t * tmp = lua_newuserdata(L, raw);
+	const uint8_t * src = data + header;
+	for (i=0;i<PLANE_N;i++) {
+		size_t psz = h[2 + i*2];
+		p.ptr[i] = tmp;
+		if (psz == p.size[i]) {
+			memcpy(tmp, src, psz);
+		} else if (lz_decompress(src, psz, tmp, p.size[i])) {
+			return luaL_error(L, "Invalid etc2 supercompressed stream, bad plane %d", i);
+		}
+		src += psz;
+		tmp += p.size[i];
+	}
+	luaL_Buffer b;
+	if (output == NULL) {
+		output = (uint8_t *)luaL_buffinitsize(L, &b, (size_t)n * 16);
+	}
+	// the ext plane is a byte stream, others are counted by records
+	struct etc2stream ext;
+	ext.data = p.ptr[PLANE_EXT];
+	ext.data_len = p.size[PLANE_EXT];
+	size_t ext_offset = 0;
+	size_t na = p.size[PLANE_ALPHA_ENDPOINT] / 2;
+	size_t nc = p.size[PLANE_COLOR_ENDPOINT] / 4;
+	const uint8_t * desc = p.ptr[PLANE_DESC];
+	for (i=0;i<n;i++) {
+		uint8_t * block = output + (size_t)i * 16;
+		int type = (desc[i/4] >> ((i & 3) * 2)) & 3;
+		int color = 1;
+		switch (type) {
+		case ETC2_EMPTY:
+			memset(block, 0, 16);
+			color = 0;
+			break;
+		case ETC2_OPAQUE:
+			memset(block, 0, 8);
+			block[0] = 255;
+			break;
+		case ETC2_RGBA:
+			if (p.count[PLANE_ALPHA_ENDPOINT] >= na)
+				return luaL_error(L, "Invalid etc2 supercompressed stream at block %d", i);
+			plane_read(&p, PLANE_ALPHA_ENDPOINT, block, 2);
+			plane_read(&p, PLANE_ALPHA_SELECTOR, block + 2, 6);
+			break;
+		case ETC2_EXTENDED:
+			if (ext_offset + 2 > ext.data_len)
+				return luaL_error(L, "Invalid etc2 supercompressed stream at block %d", i);
+			if (ext.data[ext_offset] == ETC2_TAG_ALPHA) {
+				memset(block, 0, 8);
+				block[0] = ext.data[ext_offset + 1];
+				ext_offset += 2;
+			} else if (ext.data[ext_offset] == ETC2_TAG_REFERENCE) {
+				++ext_offset;
+				uint32_t distance = varint_read(L, &ext, &ext_offset);
+				if (distance == 0 || distance > (uint32_t)i)
+					return luaL_error(L, "Invalid etc2 supercompressed stream, bad reference at block %d", i);
+				memcpy(block, block - (size_t)distance * 16, 16);
+				color = 0;
+			} else {
+				return luaL_error(L, "Invalid etc2 supercompressed stream, unknown tag at block %d", i);
+			}
+			break;
+		}
+		if (color) {
+			if (p.count[PLANE_COLOR_ENDPOINT] >= nc)
+				return luaL_error(L, "Invalid etc2 supercompressed stream at block %d", i);
+			plane_read(&p, PLANE_COLOR_ENDPOINT, block + 8, 4);
+			plane_read(&p, PLANE_COLOR_SELECTOR, block + 12, 4);
+		}
+	}
+	if (p.count[PLANE_ALPHA_ENDPOINT] != na || p.count[PLANE_COLOR_ENDPOINT] != nc || ext_offset != ext.data_len) {
+		return luaL_error(L, "Invalid etc2 supercompressed stream");
+	}
+	if (lua_isnoneornil(L, 2)) {
+		luaL_pushresultsize(&b, (size_t)n * 16);
+		lua_pushinteger(L, n);
+		lua_insert(L, -2);
+		return 2;
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
@@ -0,0 +1,187 @@
+#ifndef tbinpack_image_h
+#define tbinpack_image_h
+
+// The image userdata shared by tbinpack and etc2codec, so pixels don't need to be copied into lua strings.
+// A view (sub rect) shares the pixels of its parent, and references the parent by uservalue to keep it alive.
+// Include it after lua.h and lauxlib.h
+
+#include <stdint.h>
+#include <string.h>
+
+#define IMAGE_METATABLE "TBINPACK_IMAGE"
+#define IMAGE_RGBA8 0
+#define IMAGE_BLOCK4X4 1	// RGBA in 4x4 blocks (64 bytes per block, row-major blocks), stride is the width aligned to 4
+
+struct image {
+	uint8_t *data;
+	int width;
+	int height;
+	int stride;	// in pixels
+	int format;
+};
+
+static inline struct image *
+image_test(lua_State *L, int index) {
+	return (struct image *)luaL_testudata(L, index, IMAGE_METATABLE);
+}
+
+static inline struct image *
+image_check(lua_State *L, int index) {
+	return (struct image *)luaL_checkudata(L, index, IMAGE_METATABLE);
+}
+
+// copy 4x4 block at (x,y) into target (64 bytes), pixels out of the image are 0
+// x and y should be aligned to 4 for IMAGE_BLOCK4X4
+static inline void
+image_block(const struct image *img, int x, int y, uint8_t *target) {
+	if (img->format == IMAGE_BLOCK4X4) {
+		memcpy(target, img->data + ((size_t)(y/4) * (img->stride/4) + x/4) * 64, 64);
+		return;
+	}
+	const uint8_t * src = img->data + ((size_t)img->stride * y + x) * 4;
+	int i;
+	if (x+4 > img->width || y+4 > img->height) {
+		int n = img->width - x;
+		if (n > 4)
+			n = 4;
+		else if (n < 0)
+			n = 0;
+		memset(target, 0, 64);
+		for (i=0;i<4 && y+i < img->height;i++) {
+			memcpy(target + i * 16, src, n * 4);
+			src += img->stride * 4;
+		}
+	} else {
+		for (i=0;i<4;i++) {
+			memcpy(target + i * 16, src, 16);
+			src += img->stride * 4;
+		}
+	}
+}
+
+static void image_metatable(lua_State *L);
+
+static inline struct image *
+image_new(lua_State *L, int width, int height) {
+	if (width < 0 || height < 0) {
+		luaL_error(L, "Invalid image size %dx%d", width, height);
+	}
+	struct image * img = (struct image *)lua_newuserdata(L, sizeof(*img) + (size_t)width * height * 4);
+	img->data = (uint8_t *)(img + 1);
+	img->width = width;
+	img->height = height;
+	img->stride = width;
+	img->format = IMAGE_RGBA8;
+	image_metatable(L);
+	lua_setmetatable(L, -2);
+	return img;
+}
+
+// image of 4x4 blocks, the padding pixels are 0
+static inline struct image *
+image_newblock(lua_State *L, int width, int height) {
+	if (width < 0 || height < 0) {
+		luaL_error(L, "Invalid image size %dx%d", width, height);
+	}
+	int bw = (width + 3) / 4;
+	int bh = (height + 3) / 4;
+	size_t sz = (size_t)bw * bh * 64;
+	struct image * img = (struct image *)lua_newuserdata(L, sizeof(*img) + sz);
+	img->data = (uint8_t *)(img + 1);
+	memset(img->data, 0, sz);
+	img->width = width;
+	img->height = height;
+	img->stride = bw * 4;
+	img->format = IMAGE_BLOCK4X4;
+	image_metatable(L);
+	lua_setmetatable(L, -2);
+	return img;
+}
+
+// test the image at index, raise error if it is not IMAGE_RGBA8
+static inline struct image *
+image_rgba(lua_State *L, int index) {
+	struct image * img = image_test(L, index);
+	if (img && img->format != IMAGE_RGBA8) {
+		luaL_error(L, "Need an RGBA image (format %d)", img->format);
+	}
+	return img;
+}
+
+// push a view of the image at index
+static inline struct image *
+image_view(lua_State *L, int index, int x, int y, int w, int h) {
+	index = lua_absindex(L, index);
+	struct image * parent = image_check(L, index);
+	if (parent->format != IMAGE_RGBA8) {
+		luaL_error(L, "Can't make a view of the image (format %d)", parent->format);
+	}
+	if (x < 0 || y < 0 || w < 0 || h < 0 || x + w > parent->width || y + h > parent->height) {
+		luaL_error(L, "Invalid view (%dx%d %d,%d) of image %dx%d", w, h, x, y, parent->width, parent->height);
+	}
+	struct image * img = (struct image *)lua_newuserdata(L, sizeof(*img));
+	img->data = parent->data + ((size_t)y * parent->stride + x) * 4;
+	img->width = w;
+	img->height = h;
+	img->stride = parent->stride;
+	img->format = parent->format;
+	image_metatable(L);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, index);
+	lua_setuservalue(L, -2);
+	return img;
+}
+
+static int
+image_lsize(lua_State *L) {
+	struct image * img = image_check(L, 1);
+	lua_pushinteger(L, img->width);
+	lua_pushinteger(L, img->height);
+	return 2;
+}
+
+static int
+image_lview(lua_State *L) {
+	image_check(L, 1);
+	int x = (int)luaL_checkinteger(L, 2);
+	int y = (int)luaL_checkinteger(L, 3);
+	int w = (int)luaL_checkinteger(L, 4);
+	int h = (int)luaL_checkinteger(L, 5);
+	image_view(L, 1, x, y, w, h);
+	return 1;
+}
+
+// copy the pixels into a string, the blocks are copied as they are for IMAGE_BLOCK4X4
+static int
+image_ltostring(lua_State *L) {
+	struct image * img = image_check(L, 1);
+	if (img->format == IMAGE_BLOCK4X4) {
+		lua_pushlstring(L, (const char *)img->data, (size_t)img->stride * ((img->height + 3) / 4) * 16);
+		return 1;
+	}
+	luaL_Buffer b;
+	size_t line = (size_t)img->width * 4;
+	uint8_t * buffer = (uint8_t *)luaL_buffinitsize(L, &b, line * img->height);
+	int i;
+	for (i=0;i<img->height;i++) {
+		memcpy(buffer + i * line, img->data + (size_t)i * img->stride * 4, line);
+	}
+	luaL_pushresultsize(&b, line * img->height);
+	return 1;
+}
+
+static void
+image_metatable(lua_State *L) {
+	if (luaL_newmetatable(L, IMAGE_METATABLE)) {
+		luaL_Reg l[] = {
+			{ "size", image_lsize },
+			{ "view", image_lview },
+			{ "tostring", image_ltostring },
+			{ NULL, NULL },
+		};
+		luaL_newlib(L, l);
+		lua_setfield(L, -2, "__index");
+	}
+}
+
+#endif
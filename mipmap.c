@@ -0,0 +1,146 @@
+#include <stdint.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <math.h>
+
+#include "thread.h"
+#include "image.h"
+
+#define LINEAR_LEVELS 4096
+
+static float srgb_to_linear[256];
+static uint8_t linear_to_srgb[LINEAR_LEVELS + 1];
+static int table_init = 0;
+
+// Only called from mipmap_image on the lua thread, before thread_run, so the workers only read the tables
+static void
+init_table() {
+	if (table_init)
+		return;
+	int i;
+	for (i=0;i<256;i++) {
+		float c = i / 255.0f;
+		srgb_to_linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+	}
+	for (i=0;i<=LINEAR_LEVELS;i++) {
+		float c = (float)i / LINEAR_LEVELS;
+		c = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+		linear_to_srgb[i] = (uint8_t)(c * 255.0f + 0.5f);
+	}
+	table_init = 1;
+}
+
+struct mipmap_level {
+	const struct image *src;
+	struct image *dst;
+	int linear;	// no gamma correction
+};
+
+static inline float
+to_linear(int c, int linear) {
+	return linear ? c / 255.0f : srgb_to_linear[c];
+}
+
+static inline uint8_t
+from_linear(float c, int linear) {
+	if (c <= 0)
+		return 0;
+	if (c >= 1.0f)
+		return 255;
+	if (linear)
+		return (uint8_t)(c * 255.0f + 0.5f);
+	return linear_to_srgb[(int)(c * LINEAR_LEVELS + 0.5f)];
+}
+
+// 2x2 box filter in linear space, the colors are weighted by alpha
+// When the source size is odd, the last row/column is folded into the last texel (3 taps on that edge)
+static void
+mipmap_job(void *ud, int y) {
+	struct mipmap_level *level = (struct mipmap_level *)ud;
+	const struct image *src = level->src;
+	struct image *dst = level->dst;
+	int linear = level->linear;
+	int y0 = y * 2;
+	int ny = y0 + 1 < src->height ? 2 : 1;
+	if (y == dst->height - 1 && y0 + 3 == src->height)
+		ny = 3;
+	const uint8_t *line[3];
+	int i,j,k;
+	for (i=0;i<ny;i++) {
+		line[i] = src->data + (size_t)(y0 + i) * src->stride * 4;
+	}
+	uint8_t *output = dst->data + (size_t)y * dst->stride * 4;
+	int x;
+	for (x=0;x<dst->width;x++) {
+		int x0 = x * 2;
+		int nx = x0 + 1 < src->width ? 2 : 1;
+		if (x == dst->width - 1 && x0 + 3 == src->width)
+			nx = 3;
+		int n = nx * ny;
+		float color[3] = { 0, 0, 0 };
+		float weighted[3] = { 0, 0, 0 };
+		int alpha = 0;
+		for (i=0;i<ny;i++) {
+			const uint8_t *p = line[i] + x0 * 4;
+			for (k=0;k<nx;k++,p+=4) {
+				int a = p[3];
+				alpha += a;
+				for (j=0;j<3;j++) {
+					float c = to_linear(p[j], linear);
+					color[j] += c;
+					weighted[j] += c * a;
+				}
+			}
+		}
+		uint8_t *o = output + x * 4;
+		for (j=0;j<3;j++) {
+			float c = alpha > 0 ? weighted[j] / alpha : color[j] / n;
+			o[j] = from_linear(c, linear);
+		}
+		o[3] = (uint8_t)((alpha + n / 2) / n);
+	}
+}
+
+/*
+	image	(RGBA)
+	integer levels (optional) : max number of levels including the image, default to the full chain (1x1)
+	integer threads (default 4)
+	boolean linear : the colors are not in sRGB space, don't do gamma correction
+
+	return { image, level1, level2, ... }
+		Each level is half the size of the previous one (rounded down, at least 1),
+		the odd row/column is folded into the last texel instead of being dropped.
+		The colors are averaged in linear space and weighted by alpha, so the transparent pixels don't bleed.
+		An empty image (0 width or height) returns { image } .
+ */
+int
+mipmap_image(lua_State *L) {
+	struct image *src = image_rgba(L, 1);
+	if (src == NULL) {
+		return luaL_error(L, "Need an image");
+	}
+	int levels = luaL_optinteger(L, 2, 0);
+	int threads = luaL_optinteger(L, 3, 4);
+	int linear = lua_toboolean(L, 4);
+	init_table();
+	lua_newtable(L);
+	lua_pushvalue(L, 1);
+	lua_seti(L, -2, 1);
+	if (src->width == 0 || src->height == 0) {
+		// empty image, no pixels to filter
+		return 1;
+	}
+	int n = 1;
+	while ((levels <= 0 || n < levels) && (src->width > 1 || src->height > 1)) {
+		int w = src->width > 1 ? src->width / 2 : 1;
+		int h = src->height > 1 ? src->height / 2 : 1;
+		struct mipmap_level level;
+		level.src = src;
+		level.dst = image_new(L, w, h);
+		level.linear = linear;
+		thread_run(threads, mipmap_job, &level, h);
+		src = level.dst;
+		lua_seti(L, -2, ++n);
+	}
+	return 1;
+}
@@ -3,6 +3,10 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <string.h>
+#include <stdlib.h>
+
+#include "thread.h"
+#include "image.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -93,48 +97,67 @@ calc_rect(struct minrect *rect, stbi_uc *buffer) {
 }
 
 static void
-get_block(lua_State *L, const uint8_t * img, int w, int h, int x, int y) {
+get_block(lua_State *L, const struct image *img, int x, int y) {
 	char buffer[16*4];
-	uint8_t *target = (uint8_t *)buffer;
-	img += (w * y + x) * 4;
-	if (x+4 > w || y+4> h) {
-		int i,j;
-		for (i=0;i<4;i++) {
-			if (y+i >= h) {
-				memset(target, 0, 16);
-			} else {
-				for (j=0;j<4;j++) {
-					if (x+j >= w) {
-						target[j*4+0] = 0;
-						target[j*4+1] = 0;
-						target[j*4+2] = 0;
-						target[j*4+3] = 0;
-					} else {
-						target[j*4+0] = img[j*4+0];
-						target[j*4+1] = img[j*4+1];
-						target[j*4+2] = img[j*4+2];
-						target[j*4+3] = img[j*4+3];
-					}
-				}
-				img += w * 4;
-				target += 16;
+	image_block(img, x, y, (uint8_t *)buffer);
+	lua_pushlstring(L, buffer, 16*4);
+}
+
+// 64bit FNV-1a of the pixels in the rect, all the fully transparent pixels are treated as 0
+static uint64_t
+hash_rect(const uint8_t *img, int w, int h, int stride) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int i,j;
+	for (i=0;i<h;i++) {
+		const uint8_t *line = img + i * stride * 4;
+		for (j=0;j<w;j++) {
+			const uint8_t *c = line + j*4;
+			int k;
+			for (k=0;k<4;k++) {
+				hash ^= c[3] != 0 ? c[k] : 0;
+				hash *= 0x100000001b3ULL;
 			}
 		}
-	} else {
-		int i;
-		for (i=0;i<4;i++) {
-			memcpy(target, img, 16);
-			img += w * 4;
-			target += 16;
-		}
 	}
-	lua_pushlstring(L, buffer, 16*4);
+	return hash;
 }
 
+void transform_profile(lua_State *L, const uint8_t *rgba, int w, int h, int stride);
+int transform_checkprofile(const void *profile, int w, int h);
+
+/*
+	string filename
+	boolean loadcontent (or "linear" / "image")
+	boolean loadprofile
+	boolean hash
+
+	If loadcontent is "linear", all the 4x4 blocks are stored in one string (field blocks, 64 bytes per block, row-major),
+	rather than one string per block in the array part of the content table. There is no content field (the whole image) then.
+	If loadcontent is "image", content is an image userdata (see image.h) of the whole image instead of a table,
+	use image:view(x, y, minw, minh) for the min rect.
+
+	return width, height, x, y, minw, minh, content, profile, hash
+	(profile and hash are returned only if requested)
+ */
+
 static int
 loadimage(lua_State *L) {
 	const char *filename = luaL_checkstring(L, 1);
 	int loadcontent = lua_toboolean(L, 2);
+	int linear = 0;
+	int asimage = 0;
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		const char * mode = lua_tostring(L, 2);
+		if (strcmp(mode, "linear") == 0) {
+			linear = 1;
+		} else if (strcmp(mode, "image") == 0) {
+			asimage = 1;
+		} else {
+			return luaL_error(L, "Invalid content mode %s", mode);
+		}
+	}
+	int loadprofile = lua_toboolean(L, 3);
+	int loadhash = lua_toboolean(L, 4);
 	int x,y,channels;
 	stbi_uc * buffer = stbi_load(filename, &x, &y, &channels, 0);
 	if (buffer == NULL) {
@@ -157,74 +180,390 @@ loadimage(lua_State *L) {
 	lua_pushinteger(L, rect.y);
 	lua_pushinteger(L, rect.minw);
 	lua_pushinteger(L, rect.minh);
-	if (loadcontent) {
+	struct image src = { buffer, x, y, x, IMAGE_RGBA8 };
+	if (asimage) {
+		struct image * img = image_new(L, x, y);
+		memcpy(img->data, buffer, (size_t)x * y * 4);
+		stbi_image_free(buffer);
+		// the pixels are owned by lua now
+		src.data = img->data;
+		buffer = NULL;
+	} else if (loadcontent) {
 		int bw = rect.minw / 4 + 1;	// add 1 pixel border
 		int bh = rect.minh / 4 + 1;
-		lua_createtable(L, bw*bh, 2);
+		lua_createtable(L, linear ? 0 : bw*bh, 3);
 		lua_pushinteger(L, bw);
 		lua_setfield(L, -2, "x");
 		lua_pushinteger(L, bh);
 		lua_setfield(L, -2, "y");
 		int i,j;
-		int index = 1;
-		for (i=0;i<bh;i++) {
-			for (j=0;j<bw;j++) {
-				get_block(L, buffer, rect.width, rect.height, rect.x + j*4, rect.y + i*4);
-				lua_seti(L, -2, index);
-				++index;
+		if (linear) {
+			luaL_Buffer b;
+			size_t sz = (size_t)bw * bh * 64;
+			uint8_t * blocks = (uint8_t *)luaL_buffinitsize(L, &b, sz);
+			for (i=0;i<bh;i++) {
+				for (j=0;j<bw;j++) {
+					image_block(&src, rect.x + j*4, rect.y + i*4, blocks);
+					blocks += 64;
+				}
+			}
+			luaL_pushresultsize(&b, sz);
+			lua_setfield(L, -2, "blocks");
+		} else {
+			int index = 1;
+			for (i=0;i<bh;i++) {
+				for (j=0;j<bw;j++) {
+					get_block(L, &src, rect.x + j*4, rect.y + i*4);
+					lua_seti(L, -2, index);
+					++index;
+				}
 			}
+			// the whole image, not in linear mode (blocks is the only copy there)
+			lua_pushlstring(L, (const char *)buffer, x*y*4);
+			lua_setfield(L, -2, "content");
 		}
-		lua_pushlstring(L, (const char *)buffer, x*y*4);
-		lua_setfield(L, -2, "content");
 	} else {
 		lua_pushnil(L);
 	}
+	const uint8_t * minrect = src.data + (rect.y * x + rect.x) * 4;
+	if (loadprofile) {
+		// row spans of the min rect, for profilepack
+		transform_profile(L, minrect, rect.minw, rect.minh, x);
+	} else if (loadhash) {
+		lua_pushnil(L);
+	}
+	if (loadhash) {
+		// for duplicate detection in binpack
+		lua_pushinteger(L, (lua_Integer)hash_rect(minrect, rect.minw, rect.minh, x));
+	}
 
-	stbi_image_free(buffer);
-	return 7;
+	if (buffer)
+		stbi_image_free(buffer);
+	return loadhash ? 9 : (loadprofile ? 8 : 7);
 }
 
-static int
-binpack(lua_State *L) {
-	luaL_checktype(L, 1, LUA_TTABLE);
-	int width = luaL_checkinteger(L, 2);
-	int height = luaL_checkinteger(L, 3);
-	int border = luaL_optinteger(L, 4, 1);	// add border to each sprite
-	int n = lua_rawlen(L, 1);
+static struct stbrp_rect *
+read_rects(lua_State *L, int n, int width, int height, int border) {
 	struct stbrp_rect * rect = lua_newuserdata(L, n * sizeof(*rect));
 	int i;
 	for (i=0;i<n;i++) {
 		struct stbrp_rect * r = &rect[i];
 		int id = i + 1;
 		if (lua_geti(L, 1, i+1) != LUA_TTABLE) {
-			return luaL_error(L, "Invalid rect at index %d", id);
+			luaL_error(L, "Invalid rect at index %d", id);
 		}
 		r->id = id;
 		if (lua_getfield(L, -1, "w") != LUA_TNUMBER) {
-			return luaL_error(L, "Missing w at index %d", id);
+			luaL_error(L, "Missing w at index %d", id);
 		}
 		r->w = lua_tointeger(L, -1);
 		if (r->w > width) {
-			return luaL_error(L, "Rect at index %d's width(%d) > %d", id, r->w, width);
+			luaL_error(L, "Rect at index %d's width(%d) > %d", id, r->w, width);
 		}
 		if (lua_getfield(L, -2, "h") != LUA_TNUMBER) {
-			return luaL_error(L, "Missing h at index %d", id);
+			luaL_error(L, "Missing h at index %d", id);
 		}
 		r->h = lua_tointeger(L, -1);
 		if (r->h > height) {
-			return luaL_error(L, "Rect at index %d's height(%d) > %d", id, r->h, height);
+			luaL_error(L, "Rect at index %d's height(%d) > %d", id, r->h, height);
 		}
 		r->w += border;
 		r->h += border;
 		lua_pop(L, 3);
 	}
-	width += border;
-	height += border;
+	return rect;
+}
+
+struct rect_hash {
+	lua_Integer hash;
+	int w;
+	int h;
+	int index;
+};
+
+static int
+rect_hash_compare(const void *a, const void *b) {
+	const struct rect_hash *ra = (const struct rect_hash *)a;
+	const struct rect_hash *rb = (const struct rect_hash *)b;
+	if (ra->hash != rb->hash)
+		return ra->hash < rb->hash ? -1 : 1;
+	if (ra->w != rb->w)
+		return ra->w - rb->w;
+	if (ra->h != rb->h)
+		return ra->h - rb->h;
+	return ra->index - rb->index;
+}
+
+struct rect_pixels {
+	stbi_uc *buffer;	// loaded from the file, NULL if the rect is in an image
+	const uint8_t *data;	// the first pixel of the rect
+	int stride;	// in pixels
+	int w;
+	int h;
+};
+
+static int
+rect_field(lua_State *L, const char *key, int *v) {
+	int isnum = lua_getfield(L, -1, key) == LUA_TNUMBER;
+	*v = (int)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return isnum;
+}
+
+// the pixels of rect id (image or filename, kx, ky, w, h as combine), returns 0 if they are not available
+static int
+rect_pixels_load(lua_State *L, int id, struct rect_pixels *p) {
+	int kx, ky;
+	p->buffer = NULL;
+	lua_geti(L, 1, id);
+	if (!rect_field(L, "kx", &kx) || !rect_field(L, "ky", &ky) || !rect_field(L, "w", &p->w) || !rect_field(L, "h", &p->h)
+		|| kx < 0 || ky < 0) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_getfield(L, -1, "image");
+	// the image is referenced by the rect
+	struct image *img = image_rgba(L, -1);
+	lua_pop(L, 1);
+	int width, height;
+	if (img) {
+		width = img->width;
+		height = img->height;
+		p->stride = img->stride;
+		p->data = img->data;
+	} else {
+		if (lua_getfield(L, -1, "filename") != LUA_TSTRING) {
+			lua_pop(L, 2);
+			return 0;
+		}
+		int channels;
+		p->buffer = stbi_load(lua_tostring(L, -1), &width, &height, &channels, 4);
+		lua_pop(L, 1);
+		if (p->buffer == NULL) {
+			lua_pop(L, 1);
+			return 0;
+		}
+		p->stride = width;
+		p->data = p->buffer;
+	}
+	lua_pop(L, 1);
+	if (kx + p->w > width || ky + p->h > height) {
+		if (p->buffer)
+			stbi_image_free(p->buffer);
+		p->buffer = NULL;
+		return 0;
+	}
+	p->data += ((size_t)ky * p->stride + kx) * 4;
+	return 1;
+}
+
+static void
+rect_pixels_free(struct rect_pixels *p) {
+	if (p->buffer) {
+		stbi_image_free(p->buffer);
+		p->buffer = NULL;
+	}
+}
+
+// the same as hash_rect, the fully transparent pixels are equal
+static int
+rect_pixels_equal(const struct rect_pixels *a, const struct rect_pixels *b) {
+	if (a->w != b->w || a->h != b->h)
+		return 0;
+	int i,j;
+	for (i=0;i<a->h;i++) {
+		const uint8_t *la = a->data + (size_t)i * a->stride * 4;
+		const uint8_t *lb = b->data + (size_t)i * b->stride * 4;
+		for (j=0;j<a->w;j++) {
+			const uint8_t *ca = la + j*4;
+			const uint8_t *cb = lb + j*4;
+			if (ca[3] == 0 && cb[3] == 0)
+				continue;
+			if (memcmp(ca, cb, 4) != 0)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+struct rect_origin {
+	int id;
+	int state;	// 0: not loaded, 1: pixels loaded, -1: not available
+	struct rect_pixels pixels;
+};
+
+static void
+free_origins(struct rect_origin *origin, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		if (origin[i].state > 0)
+			rect_pixels_free(&origin[i].pixels);
+	}
+}
+
+// Rects with the same hash (from loadimage), size and pixels are packed once.
+// The pixels of the candidates are compared with each distinct rect of the group, so a hash collision doesn't make a wrong alias.
+// Set alias (the index of the packed one) for the duplicates, and remove them from rect[].
+// returns the number of rects to pack
+static int
+dedup_rects(lua_State *L, struct stbrp_rect *rect, int n) {
+	struct rect_hash * h = lua_newuserdata(L, n * sizeof(*h));
+	int i;
+	int m = 0;
+	for (i=0;i<n;i++) {
+		lua_geti(L, 1, rect[i].id);
+		if (lua_getfield(L, -1, "hash") == LUA_TNUMBER) {
+			h[m].hash = lua_tointeger(L, -1);
+			h[m].w = rect[i].w;
+			h[m].h = rect[i].h;
+			h[m].index = i;
+			++m;
+		}
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_setfield(L, -2, "alias");
+		lua_pop(L, 1);
+	}
+	if (m < 2) {
+		lua_pop(L, 1);
+		return n;
+	}
+	qsort(h, m, sizeof(*h), rect_hash_compare);
+	// the distinct rects of the group (same hash and size), a collision makes more than one
+	struct rect_origin * origin = lua_newuserdata(L, m * sizeof(*origin));
+	int norigin = 0;
+	int first = 0;
+	for (i=0;i<m;i++) {
+		if (i == 0 || h[i].hash != h[first].hash || h[i].w != h[first].w || h[i].h != h[first].h) {
+			free_origins(origin, norigin);
+			first = i;
+			origin[0].id = rect[h[i].index].id;
+			origin[0].state = 0;
+			norigin = 1;
+			continue;
+		}
+		struct stbrp_rect *r = &rect[h[i].index];
+		struct rect_origin *o = &origin[norigin];
+		o->id = r->id;
+		o->state = rect_pixels_load(L, r->id, &o->pixels) ? 1 : -1;
+		int j;
+		int alias = 0;
+		for (j=0;j<norigin && o->state > 0;j++) {
+			struct rect_origin *cmp = &origin[j];
+			if (cmp->state == 0) {
+				cmp->state = rect_pixels_load(L, cmp->id, &cmp->pixels) ? 1 : -1;
+			}
+			if (cmp->state > 0 && rect_pixels_equal(&cmp->pixels, &o->pixels)) {
+				alias = cmp->id;
+				break;
+			}
+		}
+		if (alias) {
+			if (o->state > 0)
+				rect_pixels_free(&o->pixels);
+			lua_geti(L, 1, r->id);
+			lua_pushinteger(L, alias);
+			lua_setfield(L, -2, "alias");
+			lua_pop(L, 1);
+			r->id = 0;	// mark removed
+		} else {
+			// a new distinct rect (or unknown pixels), packed on its own
+			++norigin;
+		}
+	}
+	free_origins(origin, norigin);
+	lua_pop(L, 1);
+	lua_pop(L, 1);
+	m = 0;
+	for (i=0;i<n;i++) {
+		if (rect[i].id != 0) {
+			rect[m++] = rect[i];
+		}
+	}
+	return m;
+}
+
+// copy x, y, tid (and mesh of profilepack) to the duplicates
+static void
+apply_alias(lua_State *L, int n) {
+	int i;
+	for (i=1;i<=n;i++) {
+		lua_geti(L, 1, i);
+		if (lua_getfield(L, -1, "alias") == LUA_TNUMBER) {
+			lua_geti(L, 1, lua_tointeger(L, -1));
+			lua_getfield(L, -1, "x");
+			lua_setfield(L, -4, "x");
+			lua_getfield(L, -1, "y");
+			lua_setfield(L, -4, "y");
+			lua_getfield(L, -1, "tid");
+			lua_setfield(L, -4, "tid");
+			lua_getfield(L, -1, "mesh");
+			lua_setfield(L, -4, "mesh");
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 2);
+	}
+}
+
+// For profilepack (transform.c) : set alias for the duplicates in the rects (w, h, hash) at index 1.
+// returns the number of rects to pack
+int
+tbinpack_dedup(lua_State *L, int n) {
+	struct stbrp_rect * rect = lua_newuserdata(L, n * sizeof(*rect));
+	int i;
+	for (i=0;i<n;i++) {
+		rect[i].id = i + 1;
+		lua_geti(L, 1, i + 1);
+		if (lua_type(L, -1) == LUA_TTABLE) {
+			lua_getfield(L, -1, "w");
+			rect[i].w = lua_tointeger(L, -1);
+			lua_getfield(L, -2, "h");
+			rect[i].h = lua_tointeger(L, -1);
+			lua_pop(L, 3);
+		} else {
+			// profilepack raises the error
+			rect[i].w = rect[i].h = 0;
+			lua_pop(L, 1);
+		}
+	}
+	int m = dedup_rects(L, rect, n);
+	lua_pop(L, 1);
+	return m;
+}
+
+void
+tbinpack_alias(lua_State *L, int n) {
+	apply_alias(L, n);
+}
+
+// move rects not packed to the front, returns the number of them
+static int
+remove_packed(struct stbrp_rect *rect, int n) {
+	int i;
+	int index = 0;
+	for (i=0;i<n;i++) {
+		struct stbrp_rect * r = &rect[i];
+		if (!r->was_packed) {
+			if (index != i) {
+				rect[index].id = r->id;
+				rect[index].w = r->w;
+				rect[index].h = r->h;
+			}
+			++index;
+		}
+	}
+	return index;
+}
+
+// width and height include border, returns the number of textures
+static int
+pack_rects(lua_State *L, struct stbrp_rect *rect, int n, int width, int height) {
 	int num_nodes = width * 2;
 	stbrp_node *temp = lua_newuserdata(L, num_nodes * sizeof(*temp));
 
 	stbrp_context context;
 	int texture;
+	int i;
 
 	for (texture = 0; ; ++texture) {
 		stbrp_init_target(&context, width, height, temp, num_nodes);
@@ -245,23 +584,152 @@ binpack(lua_State *L) {
 		}
 		if (all)
 			break;
-		int index = 0;
-		for (i=0;i<n;i++) {
-			struct stbrp_rect * r = &rect[i];
-			if (!r->was_packed) {
-				if (index != i) {
-					rect[index].id = r->id;
-					rect[index].w = r->w;
-					rect[index].h = r->h;
-				}
-				++index;
-			}
-		}
-		n = index;
+		n = remove_packed(rect, n);
 	}
+	lua_pop(L, 1);
+	return texture + 1;
+}
+
+static int
+binpack(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int width = luaL_checkinteger(L, 2);
+	int height = luaL_checkinteger(L, 3);
+	int border = luaL_optinteger(L, 4, 1);	// add border to each sprite
+	int n = lua_rawlen(L, 1);
+	struct stbrp_rect * rect = read_rects(L, n, width, height, border);
+	int m = dedup_rects(L, rect, n);
+	pack_rects(L, rect, m, width + border, height + border);
+	apply_alias(L, n);
 	return 0;
 }
 
+struct search_size {
+	const struct stbrp_rect *rect;
+	int n;
+	int border;
+	struct search_result {
+		int width;	// without border
+		int height;
+		int pages;	// -1 means out of memory
+	} *result;
+};
+
+static void
+search_job(void *ud, int index) {
+	struct search_size *s = (struct search_size *)ud;
+	struct search_result *result = &s->result[index];
+	int width = result->width + s->border;
+	int height = result->height + s->border;
+	int num_nodes = width * 2;
+	int n = s->n;
+	struct stbrp_rect * rect = malloc(n * sizeof(*rect) + num_nodes * sizeof(stbrp_node));
+	if (rect == NULL) {
+		result->pages = -1;
+		return;
+	}
+	stbrp_node *temp = (stbrp_node *)(rect + n);
+	memcpy(rect, s->rect, n * sizeof(*rect));
+	stbrp_context context;
+	int texture;
+	for (texture = 1; ; ++texture) {
+		stbrp_init_target(&context, width, height, temp, num_nodes);
+		if (stbrp_pack_rects (&context, rect, n))
+			break;
+		n = remove_packed(rect, n);
+	}
+	free(rect);
+	result->pages = texture;
+}
+
+static int
+better_size(const struct search_result *a, const struct search_result *b, int bypages) {
+	int64_t area_a = (int64_t)a->width * a->height * a->pages;
+	int64_t area_b = (int64_t)b->width * b->height * b->pages;
+	if (bypages && a->pages != b->pages)
+		return a->pages < b->pages;
+	if (area_a != area_b)
+		return area_a < area_b;
+	if (a->pages != b->pages)
+		return a->pages < b->pages;
+	// prefer square
+	int da = a->width > a->height ? a->width - a->height : a->height - a->width;
+	int db = b->width > b->height ? b->width - b->height : b->height - b->width;
+	return da < db;
+}
+
+/*
+	table rects
+	integer maxwidth
+	integer maxheight (default is maxwidth)
+	integer border (default 1)
+	string mode "area" (default, minimize total texels) or "pages" (minimize texture count)
+	integer threads (default 4, thread_run clamps it to THREAD_MAX 64)
+
+	Try power-of-two texture sizes (aspect ratio up to 2:1) not greater than maxwidth x maxheight,
+	and pack rects with the best one.
+	The search space is at most 31 widths x 3 heights, so result[32*32] on the stack is enough.
+
+	return width, height, pages
+ */
+static int
+binpack_search(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int maxwidth = luaL_checkinteger(L, 2);
+	int maxheight = luaL_optinteger(L, 3, maxwidth);
+	int border = luaL_optinteger(L, 4, 1);
+	static const char * const modes[] = { "area", "pages", NULL };
+	int bypages = luaL_checkoption(L, 5, "area", modes);
+	int threads = luaL_optinteger(L, 6, 4);
+	int n = lua_rawlen(L, 1);
+	struct stbrp_rect * rect = read_rects(L, n, maxwidth, maxheight, border);
+	int total = n;
+	n = dedup_rects(L, rect, n);
+	int i;
+	int minw = 1, minh = 1;
+	for (i=0;i<n;i++) {
+		if (rect[i].w - border > minw)
+			minw = rect[i].w - border;
+		if (rect[i].h - border > minh)
+			minh = rect[i].h - border;
+	}
+	int nsize = 0;
+	struct search_result result[32*32];
+	int w, h;
+	for (w = 1; w <= maxwidth && w > 0; w *= 2) {
+		if (w < minw)
+			continue;
+		for (h = 1; h <= maxheight && h > 0; h *= 2) {
+			if (h < minh || h > w * 2 || w > h * 2)
+				continue;
+			result[nsize].width = w;
+			result[nsize].height = h;
+			result[nsize].pages = 0;
+			++nsize;
+		}
+	}
+	if (nsize == 0) {
+		return luaL_error(L, "No power-of-two size (up to %dx%d) fits rect %dx%d", maxwidth, maxheight, minw, minh);
+	}
+	struct search_size s = { rect, n, border, result };
+	thread_run(threads, search_job, &s, nsize);
+	int best = -1;
+	for (i=0;i<nsize;i++) {
+		if (result[i].pages < 0)
+			return luaL_error(L, "Out of memory when packing %dx%d", result[i].width, result[i].height);
+		if (best < 0 || better_size(&result[i], &result[best], bypages))
+			best = i;
+	}
+	w = result[best].width;
+	h = result[best].height;
+	int pages = pack_rects(L, rect, n, w + border, h + border);
+	apply_alias(L, total);
+	lua_pushinteger(L, w);
+	lua_pushinteger(L, h);
+	lua_pushinteger(L, pages);
+	return 3;
+}
+
 static int
 getint(lua_State *L, const char * field, int id) {
 	if (lua_getfield(L, -1, field) != LUA_TNUMBER) {
@@ -272,70 +740,131 @@ getint(lua_State *L, const char * field, int id) {
 	return r;
 }
 
+// write n pixels at (x,y) of target, fill white if src is NULL
 static void
-write_image(lua_State *L, stbi_uc * buffer, int stride, const char * filename, int kx, int ky, int w, int h, int x, int y) {
-	int image_w, image_h, channels;
-	stbi_uc * image = stbi_load(filename, &image_w, &image_h, &channels, 4);
-	if (kx + w > image_w || ky + h > image_h) {
-		luaL_error(L, "Invalid rect (%dx%d %d,%d) for image %s (%dx%d)", w,h,kx,ky, image_w, image_h);
+write_span(struct image *target, int x, int y, const uint8_t *src, int n) {
+	if (target->format == IMAGE_RGBA8) {
+		uint8_t * ptr = target->data + ((size_t)target->stride * y + x) * 4;
+		if (src)
+			memcpy(ptr, src, n * 4);
+		else
+			memset(ptr, 0xff, n * 4);
+		return;
+	}
+	// IMAGE_BLOCK4X4, the row y&3 of the blocks in block row y/4
+	uint8_t * line = target->data + (size_t)(y/4) * (target->stride/4) * 64 + (y&3) * 16;
+	while (n > 0) {
+		int c = 4 - (x&3);
+		if (c > n)
+			c = n;
+		uint8_t * ptr = line + (x/4) * 64 + (x&3) * 4;
+		if (src) {
+			memcpy(ptr, src, c * 4);
+			src += c * 4;
+		} else {
+			memset(ptr, 0xff, c * 4);
+		}
+		x += c;
+		n -= c;
 	}
-	buffer += (stride * y + x) * 4;
-	stbi_uc * src = image + (image_w * ky + kx) * 4;
+}
+
+// profile is h rows of left/right pairs (struct segment in transform.c), copy only the pixels in the spans if not NULL
+static void
+copy_image(struct image *target, const uint8_t * src, int src_stride, int w, int h, int x, int y, const int *profile) {
 	int i;
 	for (i=0;i<h;i++) {
-		memcpy(buffer, src, w * 4);
-		buffer += stride * 4;
-		src += image_w * 4;
+		if (profile == NULL) {
+			write_span(target, x, y+i, src, w);
+		} else {
+			int left = profile[i*2];
+			int right = profile[i*2+1];
+			if (left >= 0)
+				write_span(target, x + left, y+i, src + left * 4, right - left + 1);
+		}
+		src += src_stride * 4;
 	}
+}
 
+static void
+write_image(lua_State *L, struct image *target, const char * filename, int kx, int ky, int w, int h, int x, int y, const int *profile) {
+	int image_w, image_h, channels;
+	stbi_uc * image = stbi_load(filename, &image_w, &image_h, &channels, 4);
+	if (kx + w > image_w || ky + h > image_h) {
+		luaL_error(L, "Invalid rect (%dx%d %d,%d) for image %s (%dx%d)", w,h,kx,ky, image_w, image_h);
+	}
+	copy_image(target, image + (image_w * ky + kx) * 4, image_w, w, h, x, y, profile);
 	stbi_image_free(image);
 }
 
 // draw write rect
 static void
-write_image_rect(lua_State *L, stbi_uc * buffer, int stride, int w, int h, int x, int y) {
-	buffer += (stride * y + x) * 4;
+write_image_rect(struct image *target, int w, int h, int x, int y) {
 	int i;
-	memset(buffer, 0xff, w*4);
-	for (i=0;i<h-2;i++) {
-		buffer += stride * 4;
-		buffer[0] = 0xff;
-		buffer[1] = 0xff;
-		buffer[2] = 0xff;
-		buffer[3] = 0xff;
-		buffer[w * 4 - 4] = 0xff;
-		buffer[w * 4 - 3] = 0xff;
-		buffer[w * 4 - 2] = 0xff;
-		buffer[w * 4 - 1] = 0xff;
-	}
-	if (h > 0) {
-		buffer += stride * 4;
-		memset(buffer, 0xff, w*4);
+	if (w <= 0 || h <= 0)
+		return;
+	write_span(target, x, y, NULL, w);
+	for (i=1;i<h-1;i++) {
+		write_span(target, x, y+i, NULL, 1);
+		write_span(target, x+w-1, y+i, NULL, 1);
+	}
+	if (h > 1) {
+		write_span(target, x, y+h-1, NULL, w);
 	}
 }
 
+/*
+	string filename (or nil)
+	integer width
+	integer height
+	table sources { filename or image, kx, ky, w, h, x, y, profile }
+	boolean debugline
+	string layout "rgba" (default) or "block"
+
+	A source can be an image userdata (field image) instead of a file (field filename).
+	If filename is nil, return the combined image userdata rather than write a png file.
+	The "block" layout stores the pixels in 4x4 blocks (IMAGE_BLOCK4X4), so etc2codec.compress reads each block contiguously.
+	It can't be saved as png, so the filename should be nil.
+ */
 static int
 combine(lua_State *L) {
-	const char * filename = luaL_checkstring(L, 1);
+	const char * filename = luaL_optstring(L, 1, NULL);
 	int width = luaL_checkinteger(L, 2);
 	int height = luaL_checkinteger(L, 3);
 	luaL_checktype(L, 4, LUA_TTABLE);
 	int n = lua_rawlen(L, 4);
 	int debugline = lua_toboolean(L, 5);
+	static const char * const layouts[] = { "rgba", "block", NULL };
+	int block = luaL_checkoption(L, 6, "rgba", layouts);
 	int i;
-	size_t sz = width * height * 4;
-	stbi_uc * buffer = lua_newuserdata(L, sz);
-	memset(buffer, 0, sz);
+	struct image * target;
+	if (block) {
+		if (filename) {
+			return luaL_error(L, "Block layout can't be saved to %s", filename);
+		}
+		target = image_newblock(L, width, height);
+	} else {
+		target = image_new(L, width, height);
+		memset(target->data, 0, (size_t)width * height * 4);
+	}
 	for (i=0;i<n;i++) {
 		int id = i+1;
 		if (lua_geti(L, 4, id) != LUA_TTABLE) {
 			return luaL_error(L, "Invalid source at index %d", id);
 		}
-		if (lua_getfield(L, -1, "filename") != LUA_TSTRING) {
-			return luaL_error(L, "Invalid filenanme at index %d", id);
-		}
-		const char * imagefn = luaL_checkstring(L, -1);
+		const char * imagefn = NULL;
+		struct image * img = NULL;
+		lua_getfield(L, -1, "image");
+		img = image_rgba(L, -1);
 		lua_pop(L, 1);
+		if (img == NULL) {
+			if (lua_getfield(L, -1, "filename") != LUA_TSTRING) {
+				return luaL_error(L, "Invalid filenanme at index %d", id);
+			}
+			// the string is referenced by the source table
+			imagefn = lua_tostring(L, -1);
+			lua_pop(L, 1);
+		}
 		int kx = getint(L, "kx", id);
 		int ky = getint(L, "ky", id);
 		int w = getint(L, "w", id);
@@ -345,93 +874,100 @@ combine(lua_State *L) {
 		if (kx < 0 || ky < 0 || x + w > width || y + h > height) {
 			return luaL_error(L, "Out of boundary (%dx%d %d,%d) at index %d", w,h,x,y,id);
 		}
-		lua_pop(L, 1);
+		const int * profile = NULL;
+		if (lua_getfield(L, -1, "profile") == LUA_TSTRING) {
+			size_t sz;
+			profile = (const int *)lua_tolstring(L, -1, &sz);
+			if (sz != h * 2 * sizeof(int) || !transform_checkprofile(profile, w, h)) {
+				return luaL_error(L, "Invalid profile at index %d", id);
+			}
+		}
+		lua_pop(L, 2);
 
-		write_image(L, buffer, width, imagefn, kx, ky, w, h, x, y);
+		if (img) {
+			if (kx + w > img->width || ky + h > img->height) {
+				return luaL_error(L, "Invalid rect (%dx%d %d,%d) for image (%dx%d) at index %d", w,h,kx,ky, img->width, img->height, id);
+			}
+			copy_image(target, img->data + ((size_t)img->stride * ky + kx) * 4, img->stride, w, h, x, y, profile);
+		} else {
+			write_image(L, target, imagefn, kx, ky, w, h, x, y, profile);
+		}
 		if (debugline)
-			write_image_rect(L, buffer, width, w,h, x, y);
+			write_image_rect(target, w,h, x, y);
 	}
-	if (!stbi_write_png(filename, width, height, 4, buffer, width * 4)) {
+	if (filename == NULL) {
+		return 1;
+	}
+	if (!stbi_write_png(filename, width, height, 4, target->data, width * 4)) {
 		return luaL_error(L, "Can't write to %s", filename);
 	}
 	return 0;
 }
 
-struct desc_bits {
-	uint8_t *ptr;
-	int pos;
-};
-
-static void
-write_desc_bits(struct desc_bits *bits, int type) {
-	if (bits->pos == 0) {
-		*bits->ptr = type;
-		bits->pos = 2;
-	} else {
-		*bits->ptr |= type << bits->pos;
-		bits->pos += 2;
-		if (bits->pos >= 8) {
-			++bits->ptr;
-			bits->pos = 0;
-		}
-	}
-}
-
-// each block use 2 bit description, 11 for RGBA 128bit, 10 for RGB 64bit, 00 for empty (all alpha are 0)
-// one byte store 4 blocks description from low bits to high bits, row-major order. The description bytes just follows block data.
-// for example, 7*7 blocks use 13 bytes description, follows by the data stream follows, which is 16 or 8 bytes per block.
-static int
-etc2pack(lua_State *L) {
-	luaL_checktype(L, 1, LUA_TTABLE);
-	int n = lua_rawlen(L, 1);
-	int desc_len = (n + 3)/4;
-	luaL_Buffer b;
-	luaL_buffinit(L, &b);
-	uint8_t tmp[desc_len];
-	struct desc_bits desc = { tmp, 0 };
-	int i;
-	static uint8_t c_zero[8] = { 0,0,0,0,0,0,0,0 };
-	static uint8_t c_one[8] = { 255,0,0,0,0,0,0,0 };
-	for (i = 1; i <= n; i++) {
-		lua_geti(L, 1, i);
-		size_t sz;
-		const char * block = luaL_checklstring(L, -1, &sz);
-		if (sz != 16) {
-			return luaL_error(L, "Invalid etc2 block length at index %d", i);
-		}
-		if (memcmp(c_zero, block, 8) == 0) {
-			write_desc_bits(&desc, 0);
-		} else if (memcmp(c_one, block, 8) == 0) {
-			write_desc_bits(&desc, 2);	// 10
-			luaL_addlstring(&b, (const char *)block+8, 8);	// write 64bit color only
-		} else {
-			write_desc_bits(&desc, 3);	// 11
-			luaL_addlstring(&b, (const char *)block, 16);	// write 64bit color + 64bit alpha
-		}
-		lua_pop(L, 1);
-	}
-	luaL_addlstring(&b, (const char *)tmp, desc_len);
-	luaL_pushresult(&b);
-	return 1;
-}
-
+// savepng(filename, width, height, content) or savepng(filename, image)
 static int
 savepng(lua_State *L) {
 	const char *filename = luaL_checkstring(L, 1);
+	struct image * img = image_rgba(L, 2);
+	if (img) {
+		if (!stbi_write_png(filename, img->width, img->height, 4, img->data, img->stride * 4)) {
+			return luaL_error(L, "Can't write to %s", filename);
+		}
+		return 0;
+	}
 	int width = luaL_checkinteger(L, 2);
 	int height = luaL_checkinteger(L, 3);
 	size_t sz;
-	const char * img = luaL_checklstring(L, 4, &sz);
+	const char * content = luaL_checklstring(L, 4, &sz);
 	if (sz != width * height * 4) {
 		return luaL_error(L, "Invalid image size %dx%dx4=%d, %d", width, height, width * height*4, (int)sz);
 	}
-	if (!stbi_write_png(filename, width, height, 4, img, width * 4)) {
+	if (!stbi_write_png(filename, width, height, 4, content, width * 4)) {
 		return luaL_error(L, "Can't write to %s", filename);
 	}
 	return 0;
 }
 
+/*
+	integer width
+	integer height
+	string content (optional, width * height * 4 bytes)
+
+	return an image userdata, pixels are 0 if no content
+ */
+static int
+newimage(lua_State *L) {
+	int width = luaL_checkinteger(L, 1);
+	int height = luaL_checkinteger(L, 2);
+	size_t sz = (size_t)width * height * 4;
+	const char * content = NULL;
+	if (!lua_isnoneornil(L, 3)) {
+		size_t len;
+		content = luaL_checklstring(L, 3, &len);
+		if (len != sz) {
+			return luaL_error(L, "Invalid image size %dx%dx4=%d, %d", width, height, (int)sz, (int)len);
+		}
+	}
+	// check the content before image_new, it pushes the image at index 3 when there is no content
+	struct image * img = image_new(L, width, height);
+	if (content) {
+		memcpy(img->data, content, sz);
+	} else {
+		memset(img->data, 0, sz);
+	}
+	return 1;
+}
+
+int etc2stream_pack(lua_State *L);
+int etc2stream_index(lua_State *L);
+int etc2stream_unpack(lua_State *L);
+int etc2stream_compress(lua_State *L);
+int etc2stream_decompress(lua_State *L);
 int transform_image(lua_State *L);
+int transform_batch(lua_State *L);
+int transform_rotate(lua_State *L);
+int transform_profilepack(lua_State *L);
+int mipmap_image(lua_State *L);
 
 LUAMOD_API int
 luaopen_tbinpack(lua_State *L) {
@@ -439,10 +975,20 @@ luaopen_tbinpack(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "loadimage", loadimage },
 		{ "savepng", savepng },
+		{ "image", newimage },
 		{ "binpack", binpack },
+		{ "binpack_search", binpack_search },
 		{ "combine", combine },
-		{ "etc2pack", etc2pack },
+		{ "etc2pack", etc2stream_pack },
+		{ "etc2index", etc2stream_index },
+		{ "etc2unpack", etc2stream_unpack },
+		{ "etc2compress", etc2stream_compress },
+		{ "etc2decompress", etc2stream_decompress },
 		{ "transform", transform_image },
+		{ "transform_batch", transform_batch },
+		{ "rotate", transform_rotate },
+		{ "profilepack", transform_profilepack },
+		{ "mipmap", mipmap_image },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
@@ -0,0 +1,104 @@
+-- Run by make test from the root directory.
+-- Compare etc2codec.dll with test/etc2codec_scalar.dll (built without SSE2)
+-- and test/etc2codec_reference.dll (ETC2_REFERENCE, the original routines of etcpack and etcdec).
+
+local function open(filename)
+	return assert(package.loadlib(filename, "luaopen_etc2codec"))()
+end
+
+local codec = {
+	sse2 = open "./etc2codec.dll",
+	scalar = open "./test/etc2codec_scalar.dll",
+	reference = open "./test/etc2codec_reference.dll",
+}
+
+math.randomseed(42)
+
+local function check(cond, fmt, ...)
+	if not cond then
+		error(string.format(fmt, ...), 2)
+	end
+end
+
+local function byte()
+	return math.random(0, 255)
+end
+
+local function clamp(v)
+	return v < 0 and 0 or (v > 255 and 255 or v)
+end
+
+-- 64 bytes rgba, some flat, gradient and noisy blocks
+local function random_block()
+	local kind = math.random(4)
+	local base = { byte(), byte(), byte(), byte() }
+	local noise = ({ 0, 4, 32, 255 })[math.random(4)]
+	local dx, dy = math.random(-16, 16), math.random(-16, 16)
+	local pixels = {}
+	for y = 0, 3 do
+		for x = 0, 3 do
+			local p = {}
+			for c = 1, 4 do
+				local v = base[c]
+				if kind == 2 then
+					v = v + dx * x + dy * y
+				elseif kind == 3 then
+					v = v + math.random(-noise, noise)
+				elseif kind == 4 then
+					v = byte()
+				end
+				p[c] = clamp(v)
+			end
+			pixels[#pixels + 1] = string.char(table.unpack(p))
+		end
+	end
+	return table.concat(pixels)
+end
+
+local function random_blocks(n)
+	local blocks = {}
+	for i = 1, n do
+		blocks[i] = random_block()
+	end
+	return table.concat(blocks)
+end
+
+-- compare the results of every codec with the reference one, block by block
+local function compare(name, blocksize, f)
+	local expect = f(codec.reference)
+	for _, k in ipairs { "sse2", "scalar" } do
+		local r = f(codec[k])
+		check(#r == #expect, "%s (%s) : %d bytes, should be %d", name, k, #r, #expect)
+		for i = 1, #expect, blocksize do
+			local a, b = r:sub(i, i + blocksize - 1), expect:sub(i, i + blocksize - 1)
+			check(a == b, "%s (%s) : block %d is different", name, k, (i - 1) // blocksize + 1)
+		end
+	end
+end
+
+-- the alpha search of effort 2-4 (compressBlockAlphaSlow)
+local blocks = random_blocks(256)
+compare("alpha slow", 16, function(c) return c.compress(blocks, "2n") end)
+
+-- 11-bit EAC (compressBlockAlpha16)
+blocks = random_blocks(64)
+for _, format in ipairs { "r11", "rg11", "signed_r11", "signed_rg11" } do
+	local blocksize = format:find "rg" and 16 or 8
+	compare(format, blocksize, function(c) return c.compress(blocks, nil, nil, format) end)
+	local compressed = codec.reference.compress(blocks, nil, nil, format)
+	check(codec.sse2.uncompress(compressed, format) == codec.scalar.uncompress(compressed, format), "uncompress %s is different", format)
+end
+
+-- the decoder (decompressBlockETC2c and decompressBlockAlphaC), the random bytes cover all the modes
+local compressed = { codec.reference.compress(random_blocks(256), "f") }
+for i = 1, 4096 do
+	local b = {}
+	for j = 1, 16 do
+		b[j] = byte()
+	end
+	compressed[#compressed + 1] = string.char(table.unpack(b))
+end
+compressed = table.concat(compressed)
+compare("uncompress", 64, function(c) return c.uncompress(compressed) end)
+
+print "test/etc2.lua ok"
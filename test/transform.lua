@@ -0,0 +1,242 @@
+-- Run by make test from the root directory.
+-- Compare tbinpack.dll with test/tbinpack_scalar.dll (built without SSE2),
+-- and the skew search with the original exhaustive one.
+
+local function open(filename)
+	return assert(package.loadlib(filename, "luaopen_tbinpack"))()
+end
+
+local tbinpack = open "./tbinpack.dll"
+local scalar = open "./test/tbinpack_scalar.dll"
+
+math.randomseed(42)
+
+local function check(cond, fmt, ...)
+	if not cond then
+		error(string.format(fmt, ...), 2)
+	end
+end
+
+-- DIV255 in transform.c should be x // 255 for the products of two bytes
+local function div255(x)
+	return (x + 1 + (x >> 8)) >> 8
+end
+
+for x = 0, 255 * 255 do
+	check(div255(x) == x // 255, "DIV255(%d) = %d, should be %d", x, div255(x), x // 255)
+end
+
+-- random sprite : an ellipse (may be rotated), random colors and alpha inside
+local function random_sprite(w, h)
+	local cx, cy = (w - 1) / 2, (h - 1) / 2
+	local rx, ry = math.random() * w / 2 + 1, math.random() * h / 2 + 1
+	local angle = math.random() * math.pi
+	local c, s = math.cos(angle), math.sin(angle)
+	local holes = math.random(0, 1) == 1
+	local pixels = {}
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			local dx, dy = x - cx, y - cy
+			local u, v = (dx * c + dy * s) / rx, (dy * c - dx * s) / ry
+			if u * u + v * v <= 1 and not (holes and math.random(8) == 1) then
+				pixels[#pixels + 1] = string.char(math.random(0, 255), math.random(0, 255), math.random(0, 255), math.random(1, 255))
+			else
+				pixels[#pixels + 1] = "\0\0\0\0"
+			end
+		end
+	end
+	return table.concat(pixels)
+end
+
+-- the original search of find_best_skew2 (before the pruning and the sweep of rotate_segment)
+
+-- integer division of C, rounding toward zero
+local function cdiv(a, b)
+	local q = a // b
+	if q < 0 and q * b ~= a then
+		q = q + 1
+	end
+	return q
+end
+
+local function segments(content, w, h)
+	local line = {}
+	for y = 0, h - 1 do
+		local left, right = -1, -1
+		for x = 0, w - 1 do
+			if content:byte((y * w + x) * 4 + 4) > 0 then
+				if left < 0 then
+					left = x
+				end
+				right = x
+			end
+		end
+		line[y] = { left = left, right = right }
+	end
+	return line
+end
+
+local function skew(line, n, x)
+	local output = {}
+	local left, right = math.maxinteger, math.mininteger
+	local d = n > 1 and n - 1 or 1
+	for i = 0, n - 1 do
+		local l = line[i]
+		if l.left < 0 then
+			output[i] = { left = -1, right = -1 }
+		else
+			local o = {
+				left = l.left + cdiv(x * (n - 1 - i), d),
+				right = l.right + cdiv(x * (n - 1 - i) + d - 1, d),
+			}
+			left = math.min(left, o.left)
+			right = math.max(right, o.right)
+			output[i] = o
+		end
+	end
+	for i = 0, n - 1 do
+		output[i].left = output[i].left - left
+		output[i].right = output[i].right - left
+	end
+	return output, right - left + 1, left
+end
+
+local function rotate_segment(line, n, width)
+	local col = {}
+	for i = 0, width - 1 do
+		local top, bottom = -1, -1
+		for j = 0, n - 1 do
+			local l = line[j]
+			if l.left >= 0 and l.left <= i and l.right >= i then
+				if top < 0 then
+					top = j
+				end
+				bottom = j
+			end
+		end
+		col[i] = { left = top, right = bottom }
+	end
+	return col
+end
+
+local function find_min_skew(line, n, width)
+	if n == 1 then
+		return line[0].right - line[0].left + 1, 0, 0
+	end
+	local _, w = skew(line, n, 0)
+	local right, right_skewx, right_offx = w, 0, 0
+	for i = 1, width - 1 do
+		local _, nw, off = skew(line, n, i)
+		if nw <= right then
+			right, right_skewx, right_offx = nw, i, off
+		elseif nw > right + 1 then
+			break
+		end
+	end
+	local left, left_skewx, left_offx = w, 0, 0
+	for i = 1, width - 1 do
+		local _, nw, off = skew(line, n, -i)
+		if nw < left then
+			left, left_skewx, left_offx = nw, -i, off
+		elseif nw > left + 1 then
+			break
+		end
+	end
+	if left < right then
+		return left, left_skewx, left_offx
+	end
+	return right, right_skewx, right_offx
+end
+
+local function find_best_skew(content, w, h)
+	local line = segments(content, w, h)
+	local top, bottom
+	for i = 0, h - 1 do
+		if line[i].left >= 0 then
+			top = top or i
+			bottom = i
+		end
+	end
+	local t = { w = 0, h = 0, skewx = 0, skewy = 0, offx = 0, offy = 0 }
+	if not top then
+		return t
+	end
+	local n = bottom - top + 1
+	local left, right = math.maxinteger, math.mininteger
+	local trim = {}
+	for i = 0, n - 1 do
+		local l = line[top + i]
+		trim[i] = { left = l.left, right = l.right }
+		if l.left >= 0 then
+			left = math.min(left, l.left)
+			right = math.max(right, l.right)
+		end
+	end
+	for i = 0, n - 1 do
+		if trim[i].left >= 0 then
+			trim[i].left = trim[i].left - left
+			trim[i].right = trim[i].right - left
+		end
+	end
+	local width = right - left + 1
+	t.w, t.h = width, n
+	local area = width * n
+	for i = -width, width do
+		local temp, new_width, offx = skew(trim, n, i)
+		local cols = rotate_segment(temp, n, new_width)
+		local new_height, skewy, offy = find_min_skew(cols, new_width, n)
+		if new_width * new_height < area then
+			area = new_width * new_height
+			t.w, t.h = new_width, new_height
+			t.skewx, t.skewy, t.offx, t.offy = i, skewy, offx, offy
+		end
+	end
+	return t
+end
+
+local FIELDS = { "w", "h", "skewx", "skewy", "offx", "offy" }
+
+for i = 1, 200 do
+	local w, h = math.random(1, 24), math.random(1, 24)
+	local content = random_sprite(w, h)
+	local r = tbinpack.transform(w, h, content)
+	local ref = find_best_skew(content, w, h)
+	for _, k in ipairs(FIELDS) do
+		check(r[k] == ref[k], "transform %dx%d #%d : %s = %d, should be %d", w, h, i, k, r[k], ref[k])
+	end
+end
+
+-- the SSE2 subpixel shear and transpose should produce the same pixels as the scalar ones
+for i = 1, 100 do
+	local w, h = math.random(1, 100), math.random(1, 100)
+	local content = random_sprite(w, h)
+	for _, alphaweighted in ipairs { false, true } do
+		local r1 = tbinpack.transform(w, h, content, alphaweighted)
+		local r2 = scalar.transform(w, h, content, alphaweighted)
+		for _, k in ipairs(FIELDS) do
+			check(r1[k] == r2[k], "transform %dx%d #%d : %s %d ~= %d", w, h, i, k, r1[k], r2[k])
+		end
+		check(r1.content == r2.content, "transform %dx%d #%d : the pixels are different (alphaweighted = %s)", w, h, i, alphaweighted)
+	end
+end
+
+-- etc2pack classifies the blocks with SSE2
+local blocks = {}
+for i = 1, 1000 do
+	local kind = math.random(4)
+	local alpha
+	if kind == 1 then
+		alpha = "\0\0\0\0\0\0\0\0"
+	elseif kind == 2 then
+		alpha = "\255\0\0\0\0\0\0\0"
+	elseif kind == 3 then
+		alpha = string.char(math.random(0, 255)) .. "\0\0\0\0\0\0\0"
+	else
+		alpha = string.char(math.random(0, 255), math.random(0, 255), 0, 0, 0, 0, 0, math.random(0, 1))
+	end
+	blocks[i] = alpha .. string.char(math.random(0, 3), 0, 0, 0, 0, 0, 0, 0)
+end
+blocks = table.concat(blocks)
+check(tbinpack.etc2pack(blocks) == scalar.etc2pack(blocks), "etc2pack streams are different")
+
+print "test/transform.lua ok"
@@ -22,15 +22,15 @@ local function parse_opt(...)
 	return ret
 end
 
-local function fetch_source(input_path)
+local function fetch_source(input_path, polygon)
 	local img = {}
 	for filename in lfs.dir(input_path) do
 		local name, ext = filename:match "(.*)%.(%a+)$"
 		ext = ext and ext:lower()
 		if ext == "png" or ext == "tga" then
 			filename = string.format("%s/%s", input_path, filename)
-			local w,h,x,y,minw,minh =tbinpack.loadimage(filename)
-			table.insert(img, { name = name, filename = filename, w = minw, h = minh, kx = x, ky = y } )
+			local w,h,x,y,minw,minh,_,profile,hash =tbinpack.loadimage(filename, false, polygon, true)
+			table.insert(img, { name = name, filename = filename, w = minw, h = minh, kx = x, ky = y, profile = profile, hash = hash } )
 		end
 	end
 	return img
@@ -49,8 +49,17 @@ local function output_altas(rect, filename)
 		if v.tid ~= 0 then
 			tid = string.format(" tid=%d", v.tid)
 		end
-		local line = string.format("%s kx=%d ky=%d width=%d height=%d x=%d y=%d%s\n",
-			v.filename, v.kx, v.ky, v.w, v.h, v.x, v.y, tid)
+		local mesh = ""
+		if v.mesh then
+			mesh = " mesh=" .. table.concat(v.mesh, ",")
+		end
+		local alias = ""
+		if v.alias then
+			-- the same image as rect[v.alias]
+			alias = " alias=" .. rect[v.alias].filename
+		end
+		local line = string.format("%s kx=%d ky=%d width=%d height=%d x=%d y=%d%s%s%s\n",
+			v.filename, v.kx, v.ky, v.w, v.h, v.x, v.y, tid, mesh, alias)
 		io.write(line)
 	end
 
@@ -62,13 +71,15 @@ end
 local function combine_textures(rect, filename, width, height, debugrect)
 	local t = {}
 	for _, v in ipairs(rect) do
-		local tid = v.tid + 1
-		local texture = t[tid]
-		if texture == nil then
-			texture = {}
-			t[tid] = texture
+		if not v.alias then
+			local tid = v.tid + 1
+			local texture = t[tid]
+			if texture == nil then
+				texture = {}
+				t[tid] = texture
+			end
+			table.insert(texture, v)
 		end
-		table.insert(texture, v)
 	end
 	for index, v in ipairs(t) do
 		local of = string.format("%s%d.png", filename, index-1)
@@ -84,6 +95,9 @@ Options:
 	-i inputdir
 	-w width (default is 1024)
 	-h height (default is width)
+	-auto [area|pages] (search the best power-of-two size up to width x height, default is area)
+	-threads n (threads for -auto, default is 4)
+	-polygon (pack by the outline of sprites, output the mesh of each sprite)
 
 Example:
 	lua textpack.lua -o output -i images -w 1024 -h 1024
@@ -95,10 +109,22 @@ local function main(...)
 		print(USAGE)
 	end
 	local input_path = assert(args.i)
-	local rect = fetch_source(input_path)
+	local rect = fetch_source(input_path, args.polygon)
 	local width = args.w or 1024
 	local height = args.h or width
-	tbinpack.binpack(rect, width, height)
+	if args.polygon then
+		tbinpack.profilepack(rect, width, height)
+	elseif args.auto then
+		local mode = args.auto
+		if mode == true then
+			mode = "area"
+		end
+		local pages
+		width, height, pages = tbinpack.binpack_search(rect, width, height, 1, mode, args.threads)
+		io.stderr:write(string.format("Texture size %dx%d, %d page(s)\n", width, height, pages))
+	else
+		tbinpack.binpack(rect, width, height)
+	end
 	output_altas(rect, args.o)
 	if args.image then
 		combine_textures(rect, args.o or "output", width, height, args.debug)
@@ -0,0 +1,109 @@
+#ifndef tbinpack_thread_h
+#define tbinpack_thread_h
+
+// A tiny parallel-for : run func(ud, index) for index in [0, n) on nthread threads.
+// Worker functions must not touch lua_State.
+
+#define THREAD_MAX 64
+
+typedef void (*thread_job)(void *ud, int index);
+
+struct thread_pool {
+	thread_job func;
+	void *ud;
+	int n;
+	volatile long next;
+};
+
+#if defined(_WIN32)
+
+#include <windows.h>
+#include <malloc.h>
+
+static inline int
+thread_nextjob(struct thread_pool *p) {
+	return (int)InterlockedIncrement(&p->next) - 1;
+}
+
+static DWORD WINAPI
+thread_function_(LPVOID lpParam) {
+	struct thread_pool *p = (struct thread_pool *)lpParam;
+	int index;
+	while ((index = thread_nextjob(p)) < p->n) {
+		p->func(p->ud, index);
+	}
+	return 0;
+}
+
+static void
+thread_start_(struct thread_pool *p, int nthread) {
+	HANDLE handle[THREAD_MAX];
+	int i;
+	int m = 0;
+	for (i=0;i<nthread;i++) {
+		handle[m] = CreateThread(NULL, 0, thread_function_, (LPVOID)p, 0, NULL);
+		if (handle[m] != NULL)
+			++m;
+	}
+	// Run jobs in current thread as well, so that it works even if CreateThread fails.
+	thread_function_((LPVOID)p);
+	if (m > 0) {
+		WaitForMultipleObjects(m, handle, TRUE, INFINITE);
+		for (i=0;i<m;i++) {
+			CloseHandle(handle[i]);
+		}
+	}
+}
+
+#else
+
+#include <pthread.h>
+
+static inline int
+thread_nextjob(struct thread_pool *p) {
+	return (int)__sync_fetch_and_add(&p->next, 1);
+}
+
+static void *
+thread_function_(void *arg) {
+	struct thread_pool *p = (struct thread_pool *)arg;
+	int index;
+	while ((index = thread_nextjob(p)) < p->n) {
+		p->func(p->ud, index);
+	}
+	return NULL;
+}
+
+static void
+thread_start_(struct thread_pool *p, int nthread) {
+	pthread_t handle[THREAD_MAX];
+	int i;
+	int m = 0;
+	for (i=0;i<nthread;i++) {
+		if (pthread_create(&handle[m], NULL, thread_function_, p) == 0)
+			++m;
+	}
+	thread_function_(p);
+	for (i=0;i<m;i++) {
+		pthread_join(handle[i], NULL);
+	}
+}
+
+#endif
+
+static void
+thread_run(int nthread, thread_job func, void *ud, int n) {
+	struct thread_pool p;
+	p.func = func;
+	p.ud = ud;
+	p.n = n;
+	p.next = 0;
+	if (nthread > n)
+		nthread = n;
+	if (nthread > THREAD_MAX)
+		nthread = THREAD_MAX;
+	// current thread is a worker too
+	thread_start_(&p, nthread - 1);
+}
+
+#endif
@@ -6,6 +6,17 @@
 #include <lauxlib.h>
 #include <math.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "thread.h"
+#include "image.h"
+
+// in tbinpack.c
+int tbinpack_dedup(lua_State *L, int n);
+void tbinpack_alias(lua_State *L, int n);
+
 struct segment {
 	int left;
 	int right;
@@ -44,13 +55,14 @@ static int
 skew(struct segment *line, int n, int x, struct segment *output, int *offx) {
 	int i;
 	int left=INT32_MAX,right=INT32_MIN;
+	int d = n > 1 ? n - 1 : 1;
 	for (i=0;i<n;i++) {
 		if (line[i].left < 0) {
 			output[i].left = output[i].right = -1;
 			continue;
 		}
-		int shiftl = x * (n-1-i) / (n-1);
-		int shiftr = (x * (n-1-i) + n - 2 ) / (n-1);
+		int shiftl = x * (n-1-i) / d;
+		int shiftr = (x * (n-1-i) + d - 1 ) / d;
 		output[i].left = line[i].left + shiftl;
 		if (output[i].left < left) {
 			left = output[i].left;
@@ -68,48 +80,107 @@ skew(struct segment *line, int n, int x, struct segment *output, int *offx) {
 	return right-left+1;
 }
 
+static inline int
+next_column(int *next, int i) {
+	int r = i;
+	while (next[r] != r)
+		r = next[r];
+	// path compression
+	while (next[i] != r) {
+		int t = next[i];
+		next[i] = r;
+		i = t;
+	}
+	return r;
+}
+
+// Sweep the rows from top to bottom (and then bottom to top), each column is assigned once.
+// next[] skips the assigned columns, so it's O(width + n) rather than O(width * n).
+// next should be width+1 ints
 static void
-rotate_segment(struct segment *line, int n, int width, struct segment *col) {
-	int i,j;
+rotate_segment(struct segment *line, int n, int width, struct segment *col, int *next) {
+	int i,j,c;
+	for (i=0;i<=width;i++) {
+		next[i] = i;
+	}
 	for (i=0;i<width;i++) {
-		int top = -1;
-		for (j=0;j<n;j++) {
-			if (line[j].left < 0)
-				continue;
-			if (line[j].left <= i && line[j].right >= i) {
-				top = j;
-				break;
-			}
-		}
-		if (top < 0) {
-			col[i].left = -1;
-			col[i].right = -1;
+		col[i].left = -1;
+		col[i].right = -1;
+	}
+	for (j=0;j<n;j++) {
+		if (line[j].left < 0)
 			continue;
+		int right = line[j].right < width ? line[j].right : width - 1;
+		for (c=next_column(next, line[j].left);c<=right;c=next_column(next, c+1)) {
+			col[c].left = j;
+			next[c] = c+1;
 		}
-		col[i].left = top;
-		col[i].right = top;
-		for (j=n-1;j>top;j--) {
-			if (line[j].left < 0)
-				continue;
-			if (line[j].left <= i && line[j].right >= i) {
-				col[i].right = j;
-				break;
-			}
+	}
+	for (i=0;i<=width;i++) {
+		next[i] = i;
+	}
+	for (j=n-1;j>=0;j--) {
+		if (line[j].left < 0)
+			continue;
+		int right = line[j].right < width ? line[j].right : width - 1;
+		for (c=next_column(next, line[j].left);c<=right;c=next_column(next, c+1)) {
+			col[c].right = j;
+			next[c] = c+1;
 		}
 	}
 }
 
+struct skew_span {
+	int left;
+	int right;
+	int k;	// n-1-i
+};
+
+// The same as skew(), but only calculate the width and offset of the non-empty spans
+static inline int
+skew_width(const struct skew_span *span, int m, int d, int x, int *offx) {
+	int i;
+	int left=INT32_MAX,right=INT32_MIN;
+	for (i=0;i<m;i++) {
+		int s = x * span[i].k;
+		int l = span[i].left + s / d;
+		int r = span[i].right + (s + d - 1) / d;
+		if (l < left)
+			left = l;
+		if (r > right)
+			right = r;
+	}
+	*offx = left;
+	return right-left+1;
+}
+
+// span should be n skew_span
 static int
-find_min_skew(struct segment *line, int n , int width, int *skewx, int *offx) {
-	struct segment temp[n];
-	int tmp_off;
-	int w = skew(line, n, 0, temp, &tmp_off);
+find_min_skew(struct segment *line, int n , int width, int *skewx, int *offx, struct skew_span *span) {
+	int m = 0;
 	int i;
+	int w;
+	for (i=0;i<n;i++) {
+		if (line[i].left >= 0) {
+			span[m].left = line[i].left;
+			span[m].right = line[i].right;
+			span[m].k = n-1-i;
+			++m;
+		}
+	}
+	if (n == 1) {
+		*skewx = 0;
+		*offx = 0;
+		return line[0].right - line[0].left + 1;
+	}
+	int d = n - 1;
+	int tmp_off;
+	w = skew_width(span, m, d, 0, &tmp_off);
 	int right = w;
 	int right_skewx = 0;
 	int right_offx = 0;
 	for (i=1;i<width;i++) {
-		int nw = skew(line, n, i, temp, &tmp_off);
+		int nw = skew_width(span, m, d, i, &tmp_off);
 		if (nw <= right) {
 			right = nw;
 			right_skewx = i;
@@ -122,7 +193,7 @@ find_min_skew(struct segment *line, int n , int width, int *skewx, int *offx) {
 	int left_skewx = 0;
 	int left_offx = 0;
 	for (i=1;i<width;i++) {
-		int nw = skew(line, n, -i, temp, &tmp_off);
+		int nw = skew_width(span, m, d, -i, &tmp_off);
 		if (nw < left) {
 			left = nw;
 			left_skewx = -i;
@@ -165,7 +236,7 @@ min_segment(struct segment *line, int n, int *width, int *offx, int *offy) {
 	}
 	n = bottom - top + 1;
 	if (top > 0) {
-		memcpy(line, line+top, n * sizeof(line[0]));
+		memmove(line, line+top, n * sizeof(line[0]));
 	}
 	int left = line[0].left;
 	int right = line[0].right;
@@ -201,28 +272,66 @@ struct transform {
 	int minh;
 };
 
+// Scratch memory for find_best_skew2, allocate once per image rather than on stack
+struct skew_scratch {
+	struct segment *temp;	// height
+	struct segment *cols;	// width * 2 + 2 (max width after skew)
+	struct skew_span *span;	// width * 2 + 2
+	int *next;	// width * 2 + 3
+};
+
+static inline size_t
+skew_scratch_size(int width, int height) {
+	size_t w = (size_t)width * 2 + 2;
+	return height * sizeof(struct segment) + w * (sizeof(struct segment) + sizeof(struct skew_span) + sizeof(int)) + sizeof(int);
+}
+
+static void
+skew_scratch_init(struct skew_scratch *s, void *buffer, int width, int height) {
+	size_t w = (size_t)width * 2 + 2;
+	s->temp = (struct segment *)buffer;
+	s->cols = s->temp + height;
+	s->span = (struct skew_span *)(s->cols + w);
+	s->next = (int *)(s->span + w);
+}
+
 static int
-find_best_skew2(struct segment *line, int height, struct transform * trans) {
+find_best_skew2(struct segment *line, int height, struct transform * trans, const struct skew_scratch *scratch) {
 	int width;
 	height = min_segment(line, height, &width, &trans->bounding_x, &trans->bounding_y);
 	trans->bounding_w = width;
 	trans->bounding_h = height;
+	if (height == 0) {
+		// empty image
+		trans->minw = trans->minh = 0;
+		return 0;
+	}
 	int area = height * width;
 	trans->minw = width;
 	trans->minh = height;
 	trans->skew_x = 0;
 	trans->skew_y = 0;
 	int i;
-	struct segment temp[height];
+	struct segment *temp = scratch->temp;
+	struct segment *cols = scratch->cols;
 	for (i=-width;i<=width;i++) {
 		int offx,offy;
 		int new_width = skew(line, height, i, temp, &offx);
 
-		struct segment cols[new_width];
-		rotate_segment(temp, height, new_width, cols);
-		
+		rotate_segment(temp, height, new_width, cols, scratch->next);
+
+		// skew y never makes a column shorter, so the area can't be less than new_width * the longest column
+		int j;
+		int maxcol = 0;
+		for (j=0;j<new_width;j++) {
+			if (cols[j].left >= 0 && cols[j].right - cols[j].left + 1 > maxcol)
+				maxcol = cols[j].right - cols[j].left + 1;
+		}
+		if (new_width * maxcol >= area)
+			continue;
+
 		int skewy;
-		int new_height = find_min_skew(cols, new_width, height, &skewy, &offy);
+		int new_height = find_min_skew(cols, new_width, height, &skewy, &offy, scratch->span);
 		int new_area = new_width * new_height;
 		if (new_area < area) {
 			area = new_area;
@@ -237,130 +346,229 @@ find_best_skew2(struct segment *line, int height, struct transform * trans) {
 	return area;
 }
 
+// x / 255 for x in [0, 65535)
+#define DIV255(x) (((x) + 1 + ((x) >> 8)) >> 8)
+
+// dest[k] = (src[k-4] * right + src[k] * left) / 255, for width+1 pixels (src[-4] and src[width*4] are 0)
 static void
 shift_subpixel(const uint8_t *src, uint8_t * dest, float subpixel, int width) {
 	int left = (int)(subpixel * 255);
 	int right = 255 - left;
-	int i,j;
+	int i;
+	int n = width * 4;
+	for (i=0;i<4;i++) {
+		dest[i] = src[i] * left / 255;
+	}
+	i = 4;
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	__m128i wl = _mm_set1_epi16(left);
+	__m128i wr = _mm_set1_epi16(right);
+	__m128i one = _mm_set1_epi16(1);
+	for (;i+16<=n;i+=16) {
+		__m128i cur = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i prev = _mm_loadu_si128((const __m128i *)(src + i - 4));
+		__m128i lo = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpacklo_epi8(cur, zero), wl),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(prev, zero), wr));
+		__m128i hi = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpackhi_epi8(cur, zero), wl),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(prev, zero), wr));
+		lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i *)(dest + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (;i<n;i++) {
+		int v = src[i-4] * right + src[i] * left;
+		dest[i] = DIV255(v);
+	}
 	for (i=0;i<4;i++) {
-		dest[0+i] = src[0+i] * left / 255;
-		for (j=4;j<width*4;j+=4) {
-			dest[j+i] = (src[j+i-4] * right + src[j+i] * left) / 255;
+		dest[n+i] = src[n+i-4] * right / 255;
+	}
+}
+
+// Blend the color channels weighted by alpha, so the color of transparent pixels doesn't bleed into the edge.
+static void
+shift_subpixel_alpha(const uint8_t *src, uint8_t * dest, float subpixel, int width) {
+	int left = (int)(subpixel * 255);
+	int right = 255 - left;
+	int i,j;
+	for (i=0;i<=width;i++) {
+		const uint8_t *p0 = i > 0 ? src + (i-1)*4 : NULL;	// previous pixel
+		const uint8_t *p1 = i < width ? src + i*4 : NULL;	// current pixel
+		int w0 = p0 ? p0[3] * right : 0;
+		int w1 = p1 ? p1[3] * left : 0;
+		int sum = w0 + w1;
+		uint8_t *d = dest + i*4;
+		d[3] = DIV255(sum);
+		if (sum == 0) {
+			d[0] = d[1] = d[2] = 0;
+			continue;
+		}
+		for (j=0;j<3;j++) {
+			int c = (p0 ? p0[j] * w0 : 0) + (p1 ? p1[j] * w1 : 0);
+			d[j] = (c + sum / 2) / sum;
 		}
-		dest[j+i] = src[j+i-4] * right / 255;
 	}
 }
 
+// skew row i of h rows, dest is the start of the output row (w + abs(offx) pixels)
 static void
-skew_x(const uint8_t *src, uint8_t * dest , int w, int h, int offx, int stride_src, int stride_dest) {
-	int i;
+skew_row(const uint8_t *src, uint8_t *dest, int w, int h, int i, int offx, int alphaweighted) {
 	if (offx < 0) {
 		dest -= offx*4;
-	} else {
 	}
-	stride_src *= 4;
-	stride_dest *= 4;
 	if (h == 1) {
 		memcpy(dest+offx*4, src, w * 4);
 		return;
 	}
-	for (i=0;i<h;i++) {
-		float shift = (float)offx * (h-1-i) / (h-1);
-		float f = floorf(shift);
-		int ishift = (int)f;
-		if (f == shift) {
-			memcpy(dest + ishift * 4, src, w*4);
+	float shift = (float)offx * (h-1-i) / (h-1);
+	float f = floorf(shift);
+	int ishift = (int)f;
+	if (f == shift) {
+		memcpy(dest + ishift * 4, src, w*4);
+	} else {
+		float subpixel = 1.0f + f - shift;
+		if (alphaweighted) {
+			shift_subpixel_alpha(src, dest + ishift * 4, subpixel, w);
 		} else {
-			float subpixel = 1.0f + f - shift;
 			shift_subpixel(src, dest + ishift * 4, subpixel, w);
 		}
-		src += stride_src;
-		dest += stride_dest;
 	}
 }
 
-static void
-rotate_image(const uint8_t *src, uint8_t *dest, int w, int h) {
+#define TRANSPOSE_TILE 16
+
+#if defined(__SSE2__)
+
+// transpose 4x4 pixels, sstride and dstride are in bytes
+static inline void
+transpose4x4(const uint8_t *src, int sstride, uint8_t *dest, int dstride) {
+	__m128i r0 = _mm_loadu_si128((const __m128i *)(src));
+	__m128i r1 = _mm_loadu_si128((const __m128i *)(src + sstride));
+	__m128i r2 = _mm_loadu_si128((const __m128i *)(src + sstride * 2));
+	__m128i r3 = _mm_loadu_si128((const __m128i *)(src + sstride * 3));
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1);	// 00 10 01 11
+	__m128i t1 = _mm_unpacklo_epi32(r2, r3);	// 20 30 21 31
+	__m128i t2 = _mm_unpackhi_epi32(r0, r1);	// 02 12 03 13
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3);	// 22 32 23 33
+	_mm_storeu_si128((__m128i *)(dest), _mm_unpacklo_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)(dest + dstride), _mm_unpackhi_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)(dest + dstride * 2), _mm_unpacklo_epi64(t2, t3));
+	_mm_storeu_si128((__m128i *)(dest + dstride * 3), _mm_unpackhi_epi64(t2, t3));
+}
+
+#endif
+
+// transpose tw x th pixels, sstride and dstride are in pixels
+static inline void
+transpose_tile(const uint8_t *src, int sstride, uint8_t *dest, int dstride, int tw, int th) {
 	int i,j;
-	for (i=0;i<h;i++) {
-		for (j=0;j<w;j++) {
-			memcpy(dest + j*h*4, src, 4);
-			src += 4;
+	i = 0;
+#if defined(__SSE2__)
+	for (;i+4<=th;i+=4) {
+		for (j=0;j+4<=tw;j+=4) {
+			transpose4x4(src + (i*sstride + j)*4, sstride*4, dest + (j*dstride + i)*4, dstride*4);
+		}
+		for (;j<tw;j++) {
+			int k;
+			for (k=0;k<4;k++) {
+				memcpy(dest + (j*dstride + i+k)*4, src + ((i+k)*sstride + j)*4, 4);
+			}
+		}
+	}
+#endif
+	for (;i<th;i++) {
+		const uint8_t *s = src + i*sstride*4;
+		uint8_t *d = dest + i*4;
+		for (j=0;j<tw;j++) {
+			memcpy(d + j*dstride*4, s + j*4, 4);
 		}
-		dest += 4;
 	}
 }
 
-int
-transform_image(lua_State *L) {
-	int width = luaL_checkinteger(L, 1);
-	int height = luaL_checkinteger(L, 2);
-	size_t sz;
-	const char * img = luaL_checklstring(L, 3, &sz);
-	if (sz != width * height * 4) {
-		return luaL_error(L, "Invalid image size %dx%dx4=%d, %d", width, height, width * height * 4, (int)sz);
+/*
+	Skew x (w x h pixels from src), and write the transpose of the columns [from, from+n) of the result into dest.
+	dest[c][i] = skewed[i][from + c]
+	Rows are skewed TRANSPOSE_TILE at a time into temp (TRANSPOSE_TILE * (w + abs(offx)) pixels),
+	so the whole skewed image is never stored.
+ */
+static void
+skew_transpose(const uint8_t *src, int stride_src, int w, int h, int offx, int alphaweighted,
+	uint8_t *dest, int stride_dest, int from, int n, uint8_t *temp) {
+	int sw = w + abs(offx);
+	int y, x, i;
+	for (y=0;y<h;y+=TRANSPOSE_TILE) {
+		int th = h - y < TRANSPOSE_TILE ? h - y : TRANSPOSE_TILE;
+		memset(temp, 0, th * sw * 4);
+		for (i=0;i<th;i++) {
+			skew_row(src + (y+i) * stride_src * 4, temp + i * sw * 4, w, h, y+i, offx, alphaweighted);
+		}
+		for (x=0;x<n;x+=TRANSPOSE_TILE) {
+			int tw = n - x < TRANSPOSE_TILE ? n - x : TRANSPOSE_TILE;
+			transpose_tile(temp + (from + x) * 4, sw, dest + (x * stride_dest + y) * 4, stride_dest, tw, th);
+		}
 	}
-	const uint8_t * buffer = (const uint8_t *)img;
+}
 
-	struct segment lines[height];
-	bitmap2segment(buffer,width,height,width,lines);
-	struct transform t={0};
-	find_best_skew2(lines, height, &t);
-
-	int w = t.bounding_w + abs(t.skew_x);
-	int h = t.bounding_h;
-	int sz1 = w*h*4;
-	uint8_t * skewx_img = malloc(sz1);
-	memset(skewx_img, 0, sz1);
-	skew_x(buffer + t.bounding_x * 4 + t.bounding_y * width * 4,	// src
-		skewx_img, // dest
-		t.bounding_w,
-		t.bounding_h,
-		t.skew_x,
-		width,	// stride for src
-		t.bounding_w + abs(t.skew_x) // stride for dest
-		);
-
-	uint8_t * skewx_img_r = malloc(sz1);
-	rotate_image(skewx_img, skewx_img_r, w,h);
-	free(skewx_img);
-
-	int w2 = h + abs(t.skew_y);
-	int h2 = t.minw;
-	int sz2 = w2*h2*4;
-	uint8_t * skewy_img = malloc(sz2);
-	memset(skewy_img, 0, sz2);
-	int offx = t.skew_offx;
-	if (t.skew_x < 0) {
-		offx -= t.skew_x;
-	}
-	skew_x(skewx_img_r + offx * h * 4,
-		skewy_img, // dest
-		h,
-		t.minw,
-		t.skew_y,
-		h,
-		w2
-		);
-	
-	free(skewx_img_r);
+static inline size_t
+transform_scratch_size(const struct transform *t) {
+	int w = t->bounding_w + abs(t->skew_x);
+	int h = t->bounding_h;
+	int w2 = h + abs(t->skew_y);
+	int temp_w = w > w2 ? w : w2;
+	return (size_t)w * h * 4 + (size_t)TRANSPOSE_TILE * temp_w * 4;
+}
 
-	uint8_t * output = malloc(sz2);
-	rotate_image(skewy_img, output, w2,h2);
-	free(skewy_img);
+// Warp the image by t into output (minw x minh). scratch is transform_scratch_size() bytes.
+static void
+transform_warp(const uint8_t *buffer, int stride, const struct transform *t, int alphaweighted, uint8_t *scratch, uint8_t *output) {
+	// The pipeline : skew x -> transpose -> skew y -> transpose.
+	// Each skew is fused with the following transpose, so only the first transposed image needs a scratch buffer.
+	int w = t->bounding_w + abs(t->skew_x);
+	int h = t->bounding_h;
+	uint8_t * skewx_img_r = scratch;
+	uint8_t * temp = skewx_img_r + (size_t)w * h * 4;
+	skew_transpose(buffer + t->bounding_x * 4 + t->bounding_y * stride * 4,	// src
+		stride,	// stride for src
+		t->bounding_w,
+		t->bounding_h,
+		t->skew_x,
+		alphaweighted,
+		skewx_img_r,	// dest
+		h,	// stride for dest
+		0, w,	// all the columns
+		temp);
 
-	int offy = t.skew_offy;
-	if (t.skew_y < 0) {
-		offy -= t.skew_y;
+	int offx = t->skew_offx;
+	if (t->skew_x < 0) {
+		offx -= t->skew_x;
+	}
+	int offy = t->skew_offy;
+	if (t->skew_y < 0) {
+		offy -= t->skew_y;
 	}
 
-	lua_newtable(L);
-	lua_pushinteger(L, t.minw);
+	skew_transpose(skewx_img_r + offx * h * 4,
+		h,
+		h,
+		t->minw,
+		t->skew_y,
+		alphaweighted,
+		output,	// dest
+		t->minw,
+		offy, t->minh,	// the columns [offy, offy + minh)
+		temp);
+}
+
+// set the fields (except content) of the table on the top
+static void
+push_transform(lua_State *L, const struct transform *t) {
+	lua_pushinteger(L, t->minw);
 	lua_setfield(L, -2, "w");
-	lua_pushinteger(L, t.minh);
+	lua_pushinteger(L, t->minh);
 	lua_setfield(L, -2, "h");
-	lua_pushlstring(L, (const char *)(output + t.minw * offy * 4), t.minw * t.minh * 4);
-	lua_setfield(L, -2, "content");
 
 	// The transform : 
 	//  1. get the bounding box of origin image
@@ -368,36 +576,36 @@ transform_image(lua_State *L) {
 	//  3. translation offset x
 	//  4. skew y
 	//  5. translation offset y
-	lua_pushinteger(L, t.skew_x);
+	lua_pushinteger(L, t->skew_x);
 	lua_setfield(L, -2, "skewx");
-	lua_pushinteger(L, t.skew_y);
+	lua_pushinteger(L, t->skew_y);
 	lua_setfield(L, -2, "skewy");
-	lua_pushinteger(L, t.skew_offx);
+	lua_pushinteger(L, t->skew_offx);
 	lua_setfield(L, -2, "offx");
-	lua_pushinteger(L, t.skew_offy);
+	lua_pushinteger(L, t->skew_offy);
 	lua_setfield(L, -2, "offy");
 
 	lua_createtable(L, 16, 0);	// mapping for ejoy2d
 
 	float x[4],y[4];
 
-	y[0] = (float)t.skew_offy - t.skew_y;
-	x[0] = t.skew_x * (y[0] - t.bounding_h) / t.bounding_h + t.skew_offx;
+	y[0] = (float)t->skew_offy - t->skew_y;
+	x[0] = t->skew_x * (y[0] - t->bounding_h) / t->bounding_h + t->skew_offx;
 
-	y[1] = (float)t.skew_offy;
-	x[1] = t.skew_x * (y[1] - t.bounding_h) / t.bounding_h + t.skew_offx + t.minw;
+	y[1] = (float)t->skew_offy;
+	x[1] = t->skew_x * (y[1] - t->bounding_h) / t->bounding_h + t->skew_offx + t->minw;
 
-	y[2] = y[0] + t.minh;
-	x[2] = t.skew_x * (y[2] - t.bounding_h) / t.bounding_h + t.skew_offx;
+	y[2] = y[0] + t->minh;
+	x[2] = t->skew_x * (y[2] - t->bounding_h) / t->bounding_h + t->skew_offx;
 
-	y[3] = y[1] + t.minh;
-	x[3] = t.skew_x * (y[3] - t.bounding_h) / t.bounding_h + t.skew_offx + t.minw;
+	y[3] = y[1] + t->minh;
+	x[3] = t->skew_x * (y[3] - t->bounding_h) / t->bounding_h + t->skew_offx + t->minw;
 
 	int uv[8] = {
 		0,0,
-		0, t.minh,
-		t.minw, t.minh,
-		t.minw, 0
+		0, t->minh,
+		t->minw, t->minh,
+		t->minw, 0
 	};
 	int i;
 	for (i=0;i<8;i++) {
@@ -411,18 +619,855 @@ transform_image(lua_State *L) {
 		x[1],y[1],
 	};
 	for (i=0;i<8;i+=2) {
-		screen[i] += t.bounding_x;
-		screen[i+1] += t.bounding_y;
+		screen[i] += t->bounding_x;
+		screen[i+1] += t->bounding_y;
 	}
 	for (i=0;i<8;i++) {
 		lua_pushnumber(L, screen[i]);
 		lua_seti(L, -2, i+9);
 	}
 	lua_setfield(L, -2, "mapping");
+}
 
-	// Notice: If lua_pushlstring raise oom error, output may leak.
+/*
+	integer width
+	integer height
+	string content
+	boolean alphaweighted
+	or
+	image content (see image.h)
+	boolean alphaweighted
 
-	free(output);
+	return { w, h, content, skewx, skewy, offx, offy, mapping }, content is an image if the source is an image.
+ */
+int
+transform_image(lua_State *L) {
+	int width, height, stride;
+	int alphaweighted;
+	const uint8_t * buffer;
+	struct image * src = image_rgba(L, 1);
+	if (src) {
+		width = src->width;
+		height = src->height;
+		stride = src->stride;
+		buffer = src->data;
+		alphaweighted = lua_toboolean(L, 2);
+	} else {
+		width = luaL_checkinteger(L, 1);
+		height = luaL_checkinteger(L, 2);
+		stride = width;
+		size_t sz;
+		const char * img = luaL_checklstring(L, 3, &sz);
+		if (sz != width * height * 4) {
+			return luaL_error(L, "Invalid image size %dx%dx4=%d, %d", width, height, width * height * 4, (int)sz);
+		}
+		buffer = (const uint8_t *)img;
+		alphaweighted = lua_toboolean(L, 4);	// blend colors weighted by alpha when skewing
+	}
+
+	struct segment * lines = lua_newuserdata(L, height * sizeof(*lines) + skew_scratch_size(width, height));
+	struct skew_scratch ss;
+	skew_scratch_init(&ss, lines + height, width, height);
+	bitmap2segment(buffer,width,height,stride,lines);
+	struct transform t={0};
+	find_best_skew2(lines, height, &t, &ss);
+
+	uint8_t * scratch = lua_newuserdata(L, transform_scratch_size(&t));
+	if (src) {
+		struct image * output = image_new(L, t.minw, t.minh);
+		transform_warp(buffer, stride, &t, alphaweighted, scratch, output->data);
+	} else {
+		luaL_Buffer b;
+		size_t sz2 = (size_t)t.minw * t.minh * 4;
+		uint8_t * output = (uint8_t *)luaL_buffinitsize(L, &b, sz2);
+		transform_warp(buffer, stride, &t, alphaweighted, scratch, output);
+		luaL_pushresultsize(&b, sz2);
+	}
+
+	lua_newtable(L);
+	lua_insert(L, -2);
+	lua_setfield(L, -2, "content");
+	push_transform(L, &t);
+
+	return 1;
+}
+
+struct transform_batch {
+	const uint8_t *img;
+	int width;
+	int height;
+	int stride;
+	int alphaweighted;
+	int error;	// out of memory
+	struct transform t;
+	uint8_t *output;
+};
+
+static void
+transform_search_job(void *ud, int index) {
+	struct transform_batch *job = (struct transform_batch *)ud + index;
+	// at least 1 byte, malloc(0) may return NULL for an empty image
+	struct segment * lines = malloc(job->height * sizeof(*lines) + skew_scratch_size(job->width, job->height) + 1);
+	if (lines == NULL) {
+		job->error = 1;
+		return;
+	}
+	struct skew_scratch ss;
+	skew_scratch_init(&ss, lines + job->height, job->width, job->height);
+	bitmap2segment(job->img, job->width, job->height, job->stride, lines);
+	memset(&job->t, 0, sizeof(job->t));
+	find_best_skew2(lines, job->height, &job->t, &ss);
+	free(lines);
+}
+
+static void
+transform_warp_job(void *ud, int index) {
+	struct transform_batch *job = (struct transform_batch *)ud + index;
+	if (job->t.minw * job->t.minh == 0) {
+		// empty or fully transparent, nothing to write (and malloc(0) may return NULL)
+		return;
+	}
+	uint8_t * scratch = malloc(transform_scratch_size(&job->t));
+	if (scratch == NULL) {
+		job->error = 1;
+		return;
+	}
+	transform_warp(job->img, job->stride, &job->t, job->alphaweighted, scratch, job->output);
+	free(scratch);
+}
+
+/*
+	table images { w, h, content } or { content }, if content is an image (w, h are from the image)
+	integer threads (default 4)
+	boolean alphaweighted
+
+	return { result of transform }, they can be passed to binpack directly.
+	The content of the result is always an image (see image.h), the sprites are warped into it directly.
+	Use image:tostring() for a string.
+ */
+int
+transform_batch(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int threads = luaL_optinteger(L, 2, 4);
+	int alphaweighted = lua_toboolean(L, 3);
+	int n = lua_rawlen(L, 1);
+	struct transform_batch * job = lua_newuserdata(L, n * sizeof(*job));
+	int i;
+	for (i=0;i<n;i++) {
+		int id = i + 1;
+		if (lua_geti(L, 1, id) != LUA_TTABLE) {
+			return luaL_error(L, "Invalid image at index %d", id);
+		}
+		lua_getfield(L, -1, "content");
+		// the content is referenced by images, so it's alive after pop
+		struct image * img = image_rgba(L, -1);
+		if (img) {
+			job[i].img = img->data;
+			job[i].width = img->width;
+			job[i].height = img->height;
+			job[i].stride = img->stride;
+			lua_pop(L, 2);
+		} else {
+			if (lua_type(L, -1) != LUA_TSTRING) {
+				return luaL_error(L, "Missing content at index %d", id);
+			}
+			if (lua_getfield(L, -2, "w") != LUA_TNUMBER) {
+				return luaL_error(L, "Missing w at index %d", id);
+			}
+			int width = lua_tointeger(L, -1);
+			if (lua_getfield(L, -3, "h") != LUA_TNUMBER) {
+				return luaL_error(L, "Missing h at index %d", id);
+			}
+			int height = lua_tointeger(L, -1);
+			size_t sz;
+			const char * content = lua_tolstring(L, -3, &sz);
+			if (sz != width * height * 4) {
+				return luaL_error(L, "Invalid image size %dx%dx4=%d, %d at index %d", width, height, width * height * 4, (int)sz, id);
+			}
+			lua_pop(L, 4);
+			job[i].img = (const uint8_t *)content;
+			job[i].width = width;
+			job[i].height = height;
+			job[i].stride = width;
+		}
+		job[i].alphaweighted = alphaweighted;
+		job[i].error = 0;
+		job[i].output = NULL;
+	}
+	thread_run(threads, transform_search_job, job, n);
+	lua_createtable(L, n, 0);	// output images, warped in place
+	for (i=0;i<n;i++) {
+		if (job[i].error) {
+			return luaL_error(L, "Out of memory at index %d", i+1);
+		}
+		job[i].output = image_new(L, job[i].t.minw, job[i].t.minh)->data;
+		lua_seti(L, -2, i+1);
+	}
+	thread_run(threads, transform_warp_job, job, n);
+	int outputs = lua_gettop(L);
+	lua_createtable(L, n, 0);
+	for (i=0;i<n;i++) {
+		if (job[i].error) {
+			return luaL_error(L, "Out of memory at index %d", i+1);
+		}
+		lua_newtable(L);
+		lua_geti(L, outputs, i+1);
+		lua_setfield(L, -2, "content");
+		push_transform(L, &job[i].t);
+		lua_seti(L, -2, i+1);
+	}
+	return 1;
+}
+
+// Push the row spans of an image as a string of struct segment (the occupancy profile)
+void
+transform_profile(lua_State *L, const uint8_t *rgba, int w, int h, int stride) {
+	luaL_Buffer b;
+	size_t sz = h * sizeof(struct segment);
+	struct segment * line = (struct segment *)luaL_buffinitsize(L, &b, sz);
+	bitmap2segment(rgba, w, h, stride, line);
+	luaL_pushresultsize(&b, sz);
+}
+
+// Check the rows of a profile : -1 <= left <= right < w, or an empty row (-1, -1)
+int
+transform_checkprofile(const void *profile, int w, int h) {
+	const struct segment *line = (const struct segment *)profile;
+	int i;
+	for (i=0;i<h;i++) {
+		int left = line[i].left;
+		int right = line[i].right;
+		if (left == -1) {
+			if (right != -1)
+				return 0;
+		} else if (left < 0 || left > right || right >= w) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+struct profile {
+	int id;
+	int w;	// without border
+	int h;
+	int x;
+	int y;
+	int tid;
+	struct segment *line;	// h rows
+	struct segment *foot;	// h + border rows, the footprint for packing
+};
+
+// Fill the empty rows inside the profile, so the outline is continuous
+static void
+fill_profile(struct segment *line, int n, int w) {
+	int i;
+	int last = -1;
+	for (i=0;i<n;i++) {
+		if (line[i].left >= 0) {
+			last = i;
+			break;
+		}
+	}
+	if (last < 0) {
+		// empty image, use the whole rect
+		for (i=0;i<n;i++) {
+			line[i].left = 0;
+			line[i].right = w - 1;
+		}
+		return;
+	}
+	for (i=0;i<last;i++) {
+		line[i] = line[last];
+	}
+	for (i=last+1;i<n;i++) {
+		if (line[i].left < 0)
+			continue;
+		if (i > last + 1) {
+			struct segment s;
+			s.left = line[i].left < line[last].left ? line[i].left : line[last].left;
+			s.right = line[i].right > line[last].right ? line[i].right : line[last].right;
+			int j;
+			for (j=last+1;j<i;j++) {
+				line[j] = s;
+			}
+		}
+		last = i;
+	}
+	for (i=last+1;i<n;i++) {
+		line[i] = line[last];
+	}
+}
+
+static inline int
+boundary_left(const struct segment *line, int n, int k) {
+	if (k == 0)
+		return line[0].left;
+	if (k == n)
+		return line[n-1].left;
+	return line[k-1].left < line[k].left ? line[k-1].left : line[k].left;
+}
+
+static inline int
+boundary_right(const struct segment *line, int n, int k) {
+	if (k == 0)
+		return line[0].right + 1;
+	if (k == n)
+		return line[n-1].right + 1;
+	return (line[k-1].right > line[k].right ? line[k-1].right : line[k].right) + 1;
+}
+
+static inline int
+collinear(const int *a, const int *b, const int *c) {
+	return (b[0] - a[0]) * (c[1] - b[1]) == (c[0] - b[0]) * (b[1] - a[1]);
+}
+
+// The outline polygon : a vertex at the left and right boundary of each row boundary k.
+// Each pixel row lies between two boundaries, so the polygon covers the whole span of the row.
+// verts should be (n+1)*4 ints, returns the number of vertices after removing collinear ones.
+static int
+outline_profile(const struct segment *line, int n, int *verts) {
+	int k;
+	int m = 0;
+	for (k=0;k<=2*n+1;k++) {
+		int v[2];
+		if (k <= n) {
+			v[0] = boundary_left(line, n, k);
+			v[1] = k;
+		} else {
+			v[0] = boundary_right(line, n, 2*n+1-k);
+			v[1] = 2*n+1-k;
+		}
+		while (m >= 2 && collinear(&verts[(m-2)*2], &verts[(m-1)*2], v)) {
+			--m;
+		}
+		verts[m*2] = v[0];
+		verts[m*2+1] = v[1];
+		++m;
+	}
+	// close the loop
+	while (m > 3 && collinear(&verts[(m-2)*2], &verts[(m-1)*2], &verts[0])) {
+		--m;
+	}
+	while (m > 3 && collinear(&verts[(m-1)*2], &verts[0], &verts[2])) {
+		memmove(verts, verts+2, (m-1) * 2 * sizeof(int));
+		--m;
+	}
+	return m;
+}
+
+// The footprint of row i covers the mesh (the spans of row i-1, i, i+1),
+// and is dilated by border at right and bottom, like binpack does.
+static void
+init_profile(struct profile *p, int border) {
+	int n = p->h;
+	const struct segment *line = p->line;
+	int i, j;
+	for (i=0;i<n+border;i++) {
+		int from = i - border - 1;
+		int to = i + 1;
+		if (from < 0)
+			from = 0;
+		if (to > n - 1)
+			to = n - 1;
+		struct segment s = line[from];
+		for (j=from+1;j<=to;j++) {
+			if (line[j].left < s.left)
+				s.left = line[j].left;
+			if (line[j].right > s.right)
+				s.right = line[j].right;
+		}
+		s.right += border;
+		p->foot[i] = s;
+	}
+}
+
+struct page {
+	uint8_t *bitmap;	// width * height
+	int *used;	// pixels used per row
+};
+
+// find the first position from top to bottom, left to right
+static int
+place_profile(const struct page *page, int width, int height, const struct profile *p, int border) {
+	int fh = p->h + border;
+	int fw = p->w + border;
+	int y, x, j;
+	for (y=0;y+fh<=height;y++) {
+		if (width - page->used[y] < p->foot[0].right - p->foot[0].left + 1)
+			continue;
+		x = 0;
+		while (x + fw <= width) {
+			for (j=0;j<fh;j++) {
+				const struct segment *s = &p->foot[j];
+				const uint8_t *row = page->bitmap + (y+j) * width;
+				int q;
+				for (q=x+s->right;q>=x+s->left;q--) {
+					if (row[q])
+						break;
+				}
+				if (q >= x+s->left) {
+					// skip the whole used span, to the first free pixel after it
+					const uint8_t *free = memchr(row + q, 0, width - q);
+					x = (free ? (int)(free - row) : width) - s->left;
+					break;
+				}
+			}
+			if (j == fh) {
+				return y * width + x;
+			}
+		}
+	}
+	return -1;
+}
+
+static void
+mark_profile(struct page *page, int width, const struct profile *p, int border) {
+	int fh = p->h + border;
+	int j;
+	for (j=0;j<fh;j++) {
+		const struct segment *s = &p->foot[j];
+		int y = p->y + j;
+		memset(page->bitmap + y * width + p->x + s->left, 1, s->right - s->left + 1);
+		page->used[y] += s->right - s->left + 1;
+	}
+}
+
+static int
+profile_compare(const void *a, const void *b) {
+	const struct profile *pa = (const struct profile *)a;
+	const struct profile *pb = (const struct profile *)b;
+	if (pa->h != pb->h)
+		return pb->h - pa->h;
+	if (pa->w != pb->w)
+		return pb->w - pa->w;
+	return pa->id - pb->id;
+}
+
+/*
+	table rects { w, h, profile (optional, from loadimage) }
+	integer width
+	integer height
+	integer border (default 1, should be at least 1 to keep the meshes apart)
+
+	Pack sprites by their occupancy profiles, so that they can interlock.
+	Set x, y, tid and mesh for each rect. mesh is the outline polygon { x1,y1, x2,y2, ... }
+	relative to the top-left of the rect.
+	The duplicates (the same hash from loadimage, see binpack) are packed once, and get alias and the same x, y, tid, mesh.
+
+	return pages (the number of textures)
+ */
+int
+transform_profilepack(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int width = luaL_checkinteger(L, 2);
+	int height = luaL_checkinteger(L, 3);
+	int border = luaL_optinteger(L, 4, 1);
+	int total = lua_rawlen(L, 1);
+	int n = tbinpack_dedup(L, total);
+	struct profile * p = lua_newuserdata(L, n * sizeof(*p));
+	int i;
+	int maxh = 0;
+	size_t segs = 0;
+	n = 0;
+	for (i=0;i<total;i++) {
+		int id = i + 1;
+		if (lua_geti(L, 1, id) != LUA_TTABLE) {
+			return luaL_error(L, "Invalid rect at index %d", id);
+		}
+		if (lua_getfield(L, -1, "alias") == LUA_TNUMBER) {
+			// the duplicate is placed by tbinpack_alias
+			lua_pop(L, 2);
+			continue;
+		}
+		lua_pop(L, 1);
+		struct profile *pr = &p[n++];
+		if (lua_getfield(L, -1, "w") != LUA_TNUMBER) {
+			return luaL_error(L, "Missing w at index %d", id);
+		}
+		pr->w = lua_tointeger(L, -1);
+		if (pr->w > width) {
+			return luaL_error(L, "Rect at index %d's width(%d) > %d", id, pr->w, width);
+		}
+		if (lua_getfield(L, -2, "h") != LUA_TNUMBER) {
+			return luaL_error(L, "Missing h at index %d", id);
+		}
+		pr->h = lua_tointeger(L, -1);
+		if (pr->h > height) {
+			return luaL_error(L, "Rect at index %d's height(%d) > %d", id, pr->h, height);
+		}
+		pr->id = id;
+		if (pr->h > maxh)
+			maxh = pr->h;
+		segs += pr->h * 2 + border;
+		lua_pop(L, 3);
+	}
+	struct segment * seg = lua_newuserdata(L, segs * sizeof(*seg));
+	for (i=0;i<n;i++) {
+		struct profile *pr = &p[i];
+		int w = pr->w;
+		int h = pr->h;
+		pr->line = seg;
+		pr->foot = seg + h;
+		seg += h + h + border;
+		lua_geti(L, 1, pr->id);
+		if (lua_getfield(L, -1, "profile") == LUA_TSTRING) {
+			size_t sz;
+			const char * profile = lua_tolstring(L, -1, &sz);
+			if (sz != h * sizeof(struct segment)) {
+				return luaL_error(L, "Invalid profile at index %d", pr->id);
+			}
+			memcpy(pr->line, profile, sz);
+			if (!transform_checkprofile(pr->line, w, h)) {
+				return luaL_error(L, "Invalid profile at index %d", pr->id);
+			}
+		} else {
+			int j;
+			for (j=0;j<h;j++) {
+				pr->line[j].left = -1;
+				pr->line[j].right = -1;
+			}
+		}
+		lua_pop(L, 2);
+		if (w > 0 && h > 0) {
+			fill_profile(pr->line, h, w);
+			init_profile(pr, border);
+		}
+	}
+	qsort(p, n, sizeof(*p), profile_compare);
+
+	width += border;
+	height += border;
+	size_t page_size = (size_t)width * height + height * sizeof(int);
+	int pages = 0;
+	struct page * page = lua_newuserdata(L, n * sizeof(*page));
+	lua_createtable(L, 0, 0);	// keep page userdata
+	for (i=0;i<n;i++) {
+		struct profile *pr = &p[i];
+		pr->x = 0;
+		pr->y = 0;
+		pr->tid = 0;
+		if (pr->w == 0 || pr->h == 0) {
+			continue;
+		}
+		int tid;
+		int pos = -1;
+		for (tid=0;tid<pages;tid++) {
+			pos = place_profile(&page[tid], width, height, pr, border);
+			if (pos >= 0)
+				break;
+		}
+		if (pos < 0) {
+			// new page
+			uint8_t * buffer = lua_newuserdata(L, page_size);
+			memset(buffer, 0, page_size);
+			lua_seti(L, -2, pages + 1);
+			page[pages].used = (int *)buffer;
+			page[pages].bitmap = buffer + height * sizeof(int);
+			tid = pages++;
+			pos = place_profile(&page[tid], width, height, pr, border);
+		}
+		pr->tid = tid;
+		pr->x = pos % width;
+		pr->y = pos / width;
+		mark_profile(&page[tid], width, pr, border);
+	}
+	lua_pop(L, 1);
+	int * verts = lua_newuserdata(L, (maxh + 1) * 4 * sizeof(int));
+	for (i=0;i<n;i++) {
+		struct profile *pr = &p[i];
+		lua_geti(L, 1, pr->id);
+		lua_pushinteger(L, pr->x);
+		lua_setfield(L, -2, "x");
+		lua_pushinteger(L, pr->y);
+		lua_setfield(L, -2, "y");
+		lua_pushinteger(L, pr->tid);
+		lua_setfield(L, -2, "tid");
+		if (pr->h > 0 && pr->w > 0) {
+			int m = outline_profile(pr->line, pr->h, verts);
+			lua_createtable(L, m * 2, 0);
+			int j;
+			for (j=0;j<m*2;j++) {
+				lua_pushinteger(L, verts[j]);
+				lua_seti(L, -2, j+1);
+			}
+			lua_setfield(L, -2, "mesh");
+		}
+		lua_pop(L, 1);
+	}
+	tbinpack_alias(L, total);
+	lua_pushinteger(L, pages);
+	return 1;
+}
+
+struct point {
+	int x;
+	int y;
+};
+
+static int
+point_compare(const void *a, const void *b) {
+	const struct point *pa = (const struct point *)a;
+	const struct point *pb = (const struct point *)b;
+	if (pa->x != pb->x)
+		return pa->x - pb->x;
+	return pa->y - pb->y;
+}
+
+static inline int64_t
+cross(struct point o, struct point a, struct point b) {
+	return (int64_t)(a.x - o.x) * (b.y - o.y) - (int64_t)(a.y - o.y) * (b.x - o.x);
+}
+
+// The corners of the pixels at the ends of each row span, returns the number of points (4 per row)
+static int
+segment_points(const struct segment *line, int n, struct point *p) {
+	int i;
+	int m = 0;
+	for (i=0;i<n;i++) {
+		if (line[i].left < 0)
+			continue;
+		p[m].x = line[i].left; p[m].y = i; ++m;
+		p[m].x = line[i].left; p[m].y = i+1; ++m;
+		p[m].x = line[i].right+1; p[m].y = i; ++m;
+		p[m].x = line[i].right+1; p[m].y = i+1; ++m;
+	}
+	return m;
+}
+
+// Andrew's monotone chain, hull is counter-clockwise (in y-up space) and should be n+1 points, returns the size of hull
+static int
+convex_hull(struct point *p, int n, struct point *hull) {
+	qsort(p, n, sizeof(*p), point_compare);
+	int i;
+	int k = 0;
+	for (i=0;i<n;i++) {
+		while (k >= 2 && cross(hull[k-2], hull[k-1], p[i]) <= 0)
+			--k;
+		hull[k++] = p[i];
+	}
+	int t = k + 1;
+	for (i=n-2;i>=0;i--) {
+		while (k >= t && cross(hull[k-2], hull[k-1], p[i]) <= 0)
+			--k;
+		hull[k++] = p[i];
+	}
+	return k - 1;
+}
+
+struct rotate_box {
+	float ex, ey;	// unit vector of the box's x axis
+	float ox, oy;	// the corner at uv (0,0)
+	float w, h;
+};
+
+static inline double
+dot_dir(struct point p, double ex, double ey) {
+	return p.x * ex + p.y * ey;
+}
+
+// Rotating calipers : the min area rect has an edge collinear with an edge of the hull.
+static void
+min_area_rect(const struct point *hull, int n, struct rotate_box *box) {
+	double best = -1;
+	int i;
+	int j = 1, k = 1, l = 1;	// max along edge, max distance from edge, min along edge
+	for (i=0;i<n;i++) {
+		struct point a = hull[i];
+		struct point b = hull[(i+1)%n];
+		double dx = b.x - a.x;
+		double dy = b.y - a.y;
+		double len = sqrt(dx*dx + dy*dy);
+		double ex = dx / len, ey = dy / len;
+		// normal points inside the hull
+		double nx = -ey, ny = ex;
+		while (dot_dir(hull[(j+1)%n], ex, ey) >= dot_dir(hull[j%n], ex, ey) && (j+1)%n != i) {
+			j = (j+1)%n;
+		}
+		if (i == 0)
+			k = j;
+		while (dot_dir(hull[(k+1)%n], nx, ny) >= dot_dir(hull[k%n], nx, ny) && (k+1)%n != i) {
+			k = (k+1)%n;
+		}
+		if (i == 0)
+			l = k;
+		while (dot_dir(hull[(l+1)%n], ex, ey) <= dot_dir(hull[l%n], ex, ey) && (l+1)%n != i) {
+			l = (l+1)%n;
+		}
+		double umin = dot_dir(hull[l], ex, ey);
+		double umax = dot_dir(hull[j], ex, ey);
+		double vmin = dot_dir(a, nx, ny);
+		double vmax = dot_dir(hull[k], nx, ny);
+		double area = (umax - umin) * (vmax - vmin);
+		if (best < 0 || area < best) {
+			best = area;
+			box->ex = (float)ex;
+			box->ey = (float)ey;
+			box->ox = (float)(umin * ex + vmin * nx);
+			box->oy = (float)(umin * ey + vmin * ny);
+			box->w = (float)(umax - umin);
+			box->h = (float)(vmax - vmin);
+		}
+	}
+}
+
+// bilinear sample at (sx, sy), the center of pixel (x,y) is (x+0.5, y+0.5)
+static void
+sample_bilinear(const uint8_t *img, int w, int h, int stride, float sx, float sy, int alphaweighted, uint8_t *out) {
+	float fx = sx - 0.5f;
+	float fy = sy - 0.5f;
+	int x0 = (int)floorf(fx);
+	int y0 = (int)floorf(fy);
+	float ax = fx - x0;
+	float ay = fy - y0;
+	float weight[4] = { (1-ax)*(1-ay), ax*(1-ay), (1-ax)*ay, ax*ay };
+	float c[4] = { 0,0,0,0 };
+	float asum = 0;
+	int i,j;
+	for (i=0;i<4;i++) {
+		int x = x0 + (i & 1);
+		int y = y0 + (i >> 1);
+		if (x < 0 || x >= w || y < 0 || y >= h)
+			continue;
+		const uint8_t *p = img + ((size_t)y * stride + x) * 4;
+		float wt = weight[i];
+		float wa = wt * p[3];
+		for (j=0;j<3;j++) {
+			c[j] += p[j] * (alphaweighted ? wa : wt);
+		}
+		asum += wa;
+	}
+	for (j=0;j<3;j++) {
+		float v = c[j];
+		if (alphaweighted)
+			v = asum > 0 ? v / asum : 0;
+		out[j] = (uint8_t)(v + 0.5f);
+	}
+	out[3] = (uint8_t)(asum + 0.5f);
+}
+
+/*
+	integer width
+	integer height
+	string content
+	boolean alphaweighted
+	or
+	image (see image.h)
+	boolean alphaweighted
+
+	Rotate the image by the angle of its min area bounding rect (from the convex hull of the opaque pixels).
+	return { w, h, content, angle, mapping }, mapping is the same as transform.
+	The content is an image if the source is an image.
+ */
+int
+transform_rotate(lua_State *L) {
+	int width, height, stride;
+	int alphaweighted;
+	const uint8_t * buffer;
+	struct image * src = image_rgba(L, 1);
+	if (src) {
+		width = src->width;
+		height = src->height;
+		stride = src->stride;
+		buffer = src->data;
+		alphaweighted = lua_toboolean(L, 2);
+	} else {
+		width = luaL_checkinteger(L, 1);
+		height = luaL_checkinteger(L, 2);
+		stride = width;
+		size_t sz;
+		const char * img = luaL_checklstring(L, 3, &sz);
+		if (sz != width * height * 4) {
+			return luaL_error(L, "Invalid image size %dx%dx4=%d, %d", width, height, width * height * 4, (int)sz);
+		}
+		buffer = (const uint8_t *)img;
+		alphaweighted = lua_toboolean(L, 4);
+	}
+	struct segment * lines = lua_newuserdata(L, height * sizeof(*lines) + (height * 4 + 1) * 2 * sizeof(struct point));
+	struct point * p = (struct point *)(lines + height);
+	struct point * hull = p + height * 4 + 1;
+	bitmap2segment(buffer, width, height, stride, lines);
+	int n = segment_points(lines, height, p);
+
+	struct rotate_box box = { 1, 0, 0, 0, 0, 0 };
+	if (n > 0) {
+		int m = convex_hull(p, n, hull);
+		min_area_rect(hull, m, &box);
+		// compare with the axis-aligned bounding box, use it if the rotation doesn't help
+		int minx = hull[0].x, maxx = hull[0].x, miny = hull[0].y, maxy = hull[0].y;
+		int i;
+		for (i=1;i<m;i++) {
+			if (hull[i].x < minx) minx = hull[i].x;
+			if (hull[i].x > maxx) maxx = hull[i].x;
+			if (hull[i].y < miny) miny = hull[i].y;
+			if (hull[i].y > maxy) maxy = hull[i].y;
+		}
+		int aw = maxx - minx;
+		int ah = maxy - miny;
+		if ((float)aw * ah <= ceilf(box.w - 0.001f) * ceilf(box.h - 0.001f)) {
+			box.ex = 1;
+			box.ey = 0;
+			box.ox = (float)minx;
+			box.oy = (float)miny;
+			box.w = (float)aw;
+			box.h = (float)ah;
+		}
+	}
+	int w = (int)ceilf(box.w - 0.001f);
+	int h = (int)ceilf(box.h - 0.001f);
+	float nx = -box.ey, ny = box.ex;
+
+	luaL_Buffer b;
+	size_t sz2 = (size_t)w * h * 4;
+	uint8_t * output;
+	if (src) {
+		output = image_new(L, w, h)->data;
+	} else {
+		output = (uint8_t *)luaL_buffinitsize(L, &b, sz2);
+	}
+	int i,j;
+	for (i=0;i<h;i++) {
+		for (j=0;j<w;j++) {
+			float u = j + 0.5f;
+			float v = i + 0.5f;
+			float sx = box.ox + u * box.ex + v * nx;
+			float sy = box.oy + u * box.ey + v * ny;
+			sample_bilinear(buffer, width, height, stride, sx, sy, alphaweighted, output + (i * w + j) * 4);
+		}
+	}
+	if (!src)
+		luaL_pushresultsize(&b, sz2);
+
+	lua_newtable(L);
+	lua_insert(L, -2);
+	lua_setfield(L, -2, "content");
+	lua_pushinteger(L, w);
+	lua_setfield(L, -2, "w");
+	lua_pushinteger(L, h);
+	lua_setfield(L, -2, "h");
+	lua_pushnumber(L, atan2f(box.ey, box.ex));
+	lua_setfield(L, -2, "angle");
+
+	lua_createtable(L, 16, 0);	// mapping for ejoy2d
+	int uv[8] = {
+		0,0,
+		0, h,
+		w, h,
+		w, 0
+	};
+	for (i=0;i<8;i++) {
+		lua_pushinteger(L, uv[i]);
+		lua_seti(L, -2, i+1);
+	}
+	for (i=0;i<8;i+=2) {
+		float u = (float)uv[i];
+		float v = (float)uv[i+1];
+		lua_pushnumber(L, box.ox + u * box.ex + v * nx);
+		lua_seti(L, -2, i+9);
+		lua_pushnumber(L, box.oy + u * box.ey + v * ny);
+		lua_seti(L, -2, i+10);
+	}
+	lua_setfield(L, -2, "mapping");
 
 	return 1;
 }